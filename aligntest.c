@@ -0,0 +1,121 @@
+/*
+ * aligntest.c - Check that aligned requests from many threads do not
+ * fail while plain ones of the same size would succeed.
+ *
+ * Built with mm.c and memlib.c as the process's own allocator, so that
+ * threads get arenas of their own, by "make test".
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+
+#define NTHREADS 16
+#define NBLOCKS  3000       /* 16 threads of these fill any one segment */
+#define SMALL    4589
+#define HUGE     (80<<20)   /* More than a segment holds */
+
+static int failed;
+
+/*
+ * check - report a block that is NULL or not aligned to align bytes
+ */
+static int check(const char *what, void *p, size_t align, size_t size)
+{
+	if (p == NULL) {
+		fprintf(stderr, "%s: memalign(%lu, %lu) failed\n", what,
+				(unsigned long)align, (unsigned long)size);
+		return 0;
+	}
+	if ((uintptr_t)p & (align - 1)) {
+		fprintf(stderr, "%s: memalign(%lu, %lu) gave %p\n", what,
+				(unsigned long)align, (unsigned long)size, p);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * huge - ask for a huge aligned block from a thread that is not the
+ * one to have used the heap first
+ */
+static void *huge(void *arg)
+{
+	void *p, *q;
+
+	(void)arg;
+	if ((p = malloc(HUGE)) == NULL)
+		return NULL;
+	free(p);
+
+	p = memalign(4096, HUGE);
+	if (!check("huge", p, 4096, HUGE)) {
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	((char *)p)[0] = ((char *)p)[HUGE-1] = 1;
+
+	// Growing it must keep the contents, and freeing it must work
+	if ((q = realloc(p, 2*HUGE)) == NULL || ((char *)q)[HUGE-1] != 1) {
+		fprintf(stderr, "huge: realloc lost the block\n");
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	free(q);
+	return NULL;
+}
+
+/*
+ * stress - fill the thread's arena with aligned blocks
+ */
+static void *stress(void *arg)
+{
+	void **blocks = arg;
+	int i;
+
+	for (i = 0; i < NBLOCKS; i++) {
+		blocks[i] = memalign(64, SMALL);
+		if (!check("stress", blocks[i], 64, SMALL)) {
+			__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	for (; i < NBLOCKS; i++)
+		blocks[i] = NULL;
+	return NULL;
+}
+
+int main(void)
+{
+	static void *blocks[NTHREADS][NBLOCKS];
+	pthread_t tid[NTHREADS];
+	void *p;
+	int i, j, round;
+
+	// The main thread takes the main arena
+	p = malloc(1);
+	free(p);
+
+	pthread_create(&tid[0], NULL, huge, NULL);
+	pthread_join(tid[0], NULL);
+
+	// The main thread frees every block, so the second round finds
+	// the first round's blocks on the arenas' remote free stacks
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < NTHREADS; i++)
+			pthread_create(&tid[i], NULL, stress, blocks[i]);
+		for (i = 0; i < NTHREADS; i++)
+			pthread_join(tid[i], NULL);
+		for (i = 0; i < NTHREADS; i++)
+			for (j = 0; j < NBLOCKS; j++)
+				free(blocks[i][j]);
+	}
+
+	if (failed) {
+		printf("aligntest: FAILED\n");
+		return 1;
+	}
+	printf("aligntest: passed\n");
+	return 0;
+}
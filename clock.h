@@ -6,6 +6,9 @@ void start_counter();
 /* Get # cycles since counter started */
 double get_counter();
 
+/* Read the cycle counter itself, for timing many short intervals */
+unsigned long long read_counter();
+
 /* Measure overhead for counter */
 double ovhd();
 
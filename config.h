@@ -33,6 +33,7 @@
     "amptjp.rep", \
     "bash.rep", \
     "boat.rep",\
+    "calloc.rep", \
     "cccp.rep", \
     "chrome.rep", \
     "coalesce-big.rep",  \
@@ -48,6 +49,7 @@
     "ls.rep", \
     "malloc.rep", \
     "malloc-free.rep", \
+    "memalign.rep", \
     "needle.rep", \
     "nlydf.rep", \
     "perl.rep", \
@@ -109,7 +111,22 @@
 /*
  * Maximum heap size in bytes
  */
-#define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#ifndef MAX_HEAP
+#if defined(DRIVER) || !defined(__LP64__)
+#define MAX_HEAP (100*(1UL<<20))  /* 100 MB */
+#else
+#define MAX_HEAP (32UL<<30)       /* 32 GB, reserved but not committed */
+#endif
+#endif
+
+/*
+ * Back the heap with huge pages of HUGE_PAGE_SIZE bytes by default:
+ * 1 on, 0 off. The driver turns them on with -H.
+ */
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 0
+#endif
+#define HUGE_PAGE_SIZE (1UL<<21)  /* 2 MB */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
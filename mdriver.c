@@ -7,6 +7,7 @@
  * Copyright (c) 2004, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE		/* for sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
@@ -18,11 +19,20 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
 
 /**********************
@@ -54,21 +64,59 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload. The records form a
+ * treap ordered on lo, whose heap priority is a hash of lo, so
+ * finding a block's neighbours takes O(log n) steps.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below this one, or next free record */
+    struct range_t *right; /* ranges above this one */
     int index;             /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* Range records are carved RANGE_CHUNK at a time from one malloc */
+#define RANGE_CHUNK 4096
+
+/* Types of request */
+enum { ALLOC, FREE, REALLOC, CALLOC, MEMALIGN };
+
+/*
+ * Characterizes a single trace operation (allocator request). Binary
+ * trace files hold an array of these as they are, so keep it packed.
+ */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    int index;                        /* index for free() to use later */
-    size_t size;                      /* byte size of alloc/realloc request */
+    unsigned int type : 3;            /* type of request */
+    unsigned int align_log : 5;       /* log2 of memalign's alignment */
+    signed int index : 24;            /* index for free() to use later */
+    unsigned int size;                /* byte size of alloc/realloc request */
 } traceop_t;
 
+/* Most block ids a trace may have, to fit index */
+#define MAX_IDS (1 << 23)
+
+/* Blocks eval_mm_valid asks mm_malloc_batch for, at each size */
+#define BATCH_BLOCKS 64
+
+/* Alignment of a memalign request */
+#define OP_ALIGN(op) ((size_t)1 << (op).align_log)
+
+/*
+ * A binary trace file is this header followed by num_ops traceop_t
+ * records, in the byte order of the machine that wrote it. mdriver -w
+ * writes one from a text trace.
+ */
+#define BINTRACE_MAGIC "mmtrace1"
+typedef struct {
+    char magic[8];       /* BINTRACE_MAGIC, without its nul */
+    int weight;
+    int num_ids;
+    int num_ops;
+    int ignore_ranges;
+} bintrace_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
     char filename[MAXLINE];
@@ -76,7 +124,9 @@ typedef struct {
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    const traceop_t *ops;/* array of requests */
+    void *map;           /* mapping of a binary trace file ops lies in... */
+    size_t map_len;      /* ... and its length, or NULL and 0 */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
     int *block_rand_base;/* index into random_data, if debug is on */
@@ -92,6 +142,38 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/*
+ * Hardware events counted over one timed run of each trace, and shown
+ * per op. Any the kernel will not count for us (no such event, no
+ * perf_event access in a container, a paranoid setting) are left out.
+ */
+enum { CNT_CYCLES, CNT_INSTRUCTIONS, CNT_L1D, CNT_LLC, CNT_DTLB,
+       CNT_BRANCH, NCOUNTERS };
+
+/* A cache read miss event of PERF_TYPE_HW_CACHE */
+#define CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    const char *name;    /* column heading */
+    const char *fmt;     /* and format for a count per op */
+    unsigned int type;   /* perf_event_attr type and config */
+    unsigned long long config;
+} counters[NCOUNTERS] = {
+    [CNT_CYCLES] = { "cyc/op", " %7.1f", PERF_TYPE_HARDWARE,
+                     PERF_COUNT_HW_CPU_CYCLES },
+    [CNT_INSTRUCTIONS] = { "ins/op", " %7.1f", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_INSTRUCTIONS },
+    [CNT_L1D] = { "L1D/op", " %7.3f", PERF_TYPE_HW_CACHE,
+                  CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    [CNT_LLC] = { "LLC/op", " %7.3f", PERF_TYPE_HW_CACHE,
+                  CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+    [CNT_DTLB] = { "dTLB/op", " %7.3f", PERF_TYPE_HW_CACHE,
+                   CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    [CNT_BRANCH] = { "brm/op", " %7.3f", PERF_TYPE_HARDWARE,
+                     PERF_COUNT_HW_BRANCH_MISSES },
+};
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -102,6 +184,9 @@ typedef struct {
     /* run-time stats defined for both libc and student */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    double counts[NCOUNTERS]; /* hardware events in one run, or -1 if
+                                 they could not be counted */
+    double lat[4];   /* p50, p99, p99.9 and max op latency in ns (-L) */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
@@ -110,6 +195,25 @@ typedef struct {
 } stats_t;
 
 
+/*
+ * Latency histograms (-L) count op latencies in cycles, HDR style:
+ * each power of two is split into LAT_SUB buckets, so a bucket is
+ * never more than 1/LAT_SUB of its values wide.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 * LAT_SUB)
+#define LAT_TYPES (MEMALIGN + 1)
+
+/* Size classes go up by 4x from requests of 16 bytes or less */
+#define LAT_SIZE_CLASSES 8
+
+typedef struct {
+    unsigned long count[LAT_BUCKETS];
+    unsigned long n;                  /* ops counted */
+    unsigned long long max;           /* longest, in cycles */
+} latency_t;
+
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
  * at a "random" place (a hash of the index), and copy random data
@@ -137,6 +241,16 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* Why the kernel last refused to count a hardware event, or 0 */
+static int counters_errno = 0;
+
+/* Op latencies, by type and by size class, over all traces (-L) */
+static int latency_mode = 0;
+static double latency_mhz;
+static unsigned long long latency_ovhd; /* cycles of two back to back reads */
+static latency_t latency_by_type[LAT_TYPES];
+static latency_t latency_by_class[LAT_SIZE_CLASSES];
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -152,20 +266,26 @@ char autoresult[MAXLINE]; /* autoresult string */
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static void check_ranges(const trace_t *trace, int opnum, range_t *ranges);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
 static void check_index(const trace_t *trace, int opnum, int index);
 static void randomize_block(trace_t *trace, int index);
+static int check_size(const trace_t *trace, int opnum, char *p,
+                      size_t size, int good);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static void parse_trace(trace_t *trace, FILE *tracefile);
+static int map_trace(trace_t *trace, const char *filename);
+static void write_trace(const trace_t *trace, const char *filename);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -176,11 +296,15 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
+static int check_batch(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void count_events(void (*f)(void *), void *argp, double *counts);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printlatency(void);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -191,6 +315,13 @@ static void app_error(const char *fmt, ...)
 
 static sigjmp_buf timeout_jmpbuf;
 
+/* Run the traces in child processes (-j) */
+static void run_worker(int tracenum, const char *tracedir, char *tracefile,
+                       int cpu, int fd) __attribute__((noreturn));
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params, int jobs);
+
 /* Timeout signal handler */
 static void timeout_handler(int sig __attribute__((unused))) {
     fprintf(stderr, "The driver timed out after %d secs\n", set_timeout);
@@ -241,6 +372,9 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+            count_events(eval_mm_speed, speed_params, mm_stats[i].counts);
+            if (latency_mode)
+                eval_mm_latency(trace, &mm_stats[i]);
         }
 
         free_trace(trace);
@@ -250,6 +384,169 @@ static void run_tests(int num_tracefiles, const char *tracedir,
     }
 }
 
+/*
+ * run_worker - In a child process pinned to cpu, check the correctness
+ *     and space utilization of trace tracenum, send its stats and error
+ *     count down fd, and exit
+ */
+static void run_worker(int tracenum, const char *tracedir, char *tracefile,
+                       int cpu, int fd)
+{
+    struct { stats_t stats; int errors; } result;
+    range_t *ranges = NULL;
+    trace_t *trace;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+
+    /* The timeout is left to the parent, which kills us when it hits */
+    memset(&result, 0, sizeof(result));
+    errors = 0;
+    mem_init();
+    trace = read_trace(&result.stats, tracedir, tracefile);
+    result.stats.valid = eval_mm_valid(trace, &ranges);
+    if (result.stats.valid)
+        result.stats.util = eval_mm_util(trace, tracenum);
+    result.errors = errors;
+
+    if (write(fd, &result, sizeof(result)) != sizeof(result))
+        unix_error("write failed in run_worker");
+    _exit(0);
+}
+
+/*
+ * run_tests_parallel - Check the correctness and utilization of up to
+ *     jobs traces at once, each in a child process with its own heap on
+ *     its own CPU. Then time the valid traces here, one at a time, so
+ *     the timings do not compete with each other or with the checks.
+ */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params, int jobs)
+{
+    struct { stats_t stats; int errors; } result;
+    pid_t *pids;        /* worker checking each trace, or 0 */
+    int *fds;           /* pipe its result comes back on */
+    int *slots;         /* slot it runs in, which picks its CPU */
+    int *cpus;          /* CPUs we may run on */
+    volatile int next = 0, running = 0;
+    int ncpus = 0;
+    int i, cpu, slot, fd[2], status;
+    cpu_set_t allowed;
+    trace_t *trace;
+    pid_t pid;
+
+    pids = calloc(num_tracefiles, sizeof(*pids));
+    fds = calloc(num_tracefiles, sizeof(*fds));
+    slots = calloc(num_tracefiles, sizeof(*slots));
+    cpus = calloc(CPU_SETSIZE, sizeof(*cpus));
+    if (pids == NULL || fds == NULL || slots == NULL || cpus == NULL)
+        unix_error("calloc failed in run_tests_parallel");
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        unix_error("sched_getaffinity failed in run_tests_parallel");
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[ncpus++] = cpu;
+
+    /* On a timeout, stop the workers; every trace not yet checked
+       and timed fails */
+    if (setjmp(timeout_jmpbuf) != 0) {
+        for (i = 0; i < num_tracefiles; i++) {
+            if (pids[i] > 0) {
+                kill(pids[i], SIGKILL);
+                waitpid(pids[i], NULL, 0);
+                close(fds[i]);
+            }
+            if (mm_stats[i].secs == 0)
+                mm_stats[i].valid = 0;
+        }
+        free(pids);
+        free(fds);
+        free(slots);
+        free(cpus);
+        return;
+    }
+
+    for (i = 0; i < num_tracefiles; i++)
+        sprintf(mm_stats[i].filename, "%s%s", tracedir, tracefiles[i]);
+
+    while (next < num_tracefiles || running > 0) {
+        /* Start a worker in the first free slot */
+        if (next < num_tracefiles && running < jobs) {
+            for (slot = 0; ; slot++) {
+                for (i = 0; i < num_tracefiles; i++)
+                    if (pids[i] > 0 && slots[i] == slot)
+                        break;
+                if (i == num_tracefiles)
+                    break;
+            }
+            if (pipe(fd) < 0)
+                unix_error("pipe failed in run_tests_parallel");
+            if ((pid = fork()) < 0)
+                unix_error("fork failed in run_tests_parallel");
+            if (pid == 0) {
+                close(fd[0]);
+                run_worker(next, tracedir, tracefiles[next],
+                           cpus[slot % ncpus], fd[1]);
+            }
+            close(fd[1]);
+            pids[next] = pid;
+            fds[next] = fd[0];
+            slots[next] = slot;
+            next++;
+            running++;
+            continue;
+        }
+
+        /* Collect the result of the next worker to finish */
+        if ((pid = wait(&status)) < 0)
+            unix_error("wait failed in run_tests_parallel");
+        for (i = 0; i < num_tracefiles && pids[i] != pid; i++)
+            ;
+        if (i == num_tracefiles)
+            continue;
+        if (read(fds[i], &result, sizeof(result)) == sizeof(result)) {
+            mm_stats[i] = result.stats;
+            errors += result.errors;
+        }
+        else {
+            fprintf(stderr, "The worker checking %s died\n",
+                    mm_stats[i].filename);
+            mm_stats[i].valid = 0;
+            errors++;
+        }
+        close(fds[i]);
+        pids[i] = 0;
+        running--;
+    }
+
+    /* Time the valid traces */
+    for (i = 0; i < num_tracefiles; i++) {
+        if (!mm_stats[i].valid)
+            continue;
+        if (verbose > 1)
+            printf("Timing %s\n", mm_stats[i].filename);
+        mem_init();
+        trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
+        speed_params->trace = trace;
+        speed_params->ranges = NULL;
+        mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+        count_events(eval_mm_speed, speed_params, mm_stats[i].counts);
+        if (latency_mode)
+            eval_mm_latency(trace, &mm_stats[i]);
+        free_trace(trace);
+        mem_deinit();
+    }
+
+    free(pids);
+    free(fds);
+    free(slots);
+    free(cpus);
+}
+
 /**************
  * Main routine
  **************/
@@ -266,7 +563,10 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
+    int huge_pages = 0;   /* If set, heap on huge pages (set by -H) */
     int autograder = 0;   /* if set then called by autograder (-A) */
+    char *binfile = NULL; /* If set, convert the trace to this file (-w) */
+    int jobs = 1;         /* Traces to check at once (set by -j) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
@@ -280,7 +580,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:j:s:t:T:v:w:hVAlDHL")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -338,6 +638,28 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'L': /* Measure the latency of every request */
+            latency_mode = 1;
+            break;
+
+        case 'j': /* Check this many traces at once */
+            jobs = atoi(optarg);
+            break;
+
+        case 'T': /* Trim free blocks this large, which the driver
+                     build does not by default */
+            mm_set_trim_threshold(strtoul(optarg, NULL, 0));
+            break;
+
+        case 'H': /* Back the heap with huge pages */
+            huge_pages = 1;
+            mem_set_hugepages(1);
+            break;
+
+        case 'w': /* Write the trace out as a binary trace */
+            binfile = optarg;
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -348,6 +670,19 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Convert the one trace given to a binary trace, and stop */
+    if (binfile != NULL) {
+        stats_t stats;
+        trace_t *trace;
+
+        if (num_tracefiles != 1)
+            app_error("-w needs one trace, given with -f");
+        trace = read_trace(&stats, tracedir, tracefiles[0]);
+        write_trace(trace, binfile);
+        free_trace(trace);
+        exit(0);
+    }
+
     if (tracefiles == NULL) {
         tracefiles = default_tracefiles;
         num_tracefiles = sizeof(default_tracefiles) / sizeof(char *) - 1;
@@ -361,6 +696,19 @@ int main(int argc, char **argv)
     /* Initialize the timing package */
     init_fsecs();
 
+    /* Latencies leave out the time it takes to read the counter */
+    if (latency_mode) {
+        latency_mhz = mhz(0);
+        latency_ovhd = ~0ULL;
+        for (i = 0; i < 1000; i++) {
+            unsigned long long start = read_counter();
+            unsigned long long cycles = read_counter() - start;
+
+            if (cycles < latency_ovhd)
+                latency_ovhd = cycles;
+        }
+    }
+
     /* Initialize the timeout */
     if (set_timeout > 0) {
         signal(SIGALRM, timeout_handler);
@@ -391,6 +739,8 @@ int main(int argc, char **argv)
                 if (verbose > 1)
                     printf("and performance.\n");
                 libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+                count_events(eval_libc_speed, &speed_params,
+                             libc_stats[i].counts);
             }
             free_trace(trace);
         }
@@ -413,8 +763,12 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
-              ranges, &speed_params);
+    if (jobs > 1 && !onetime_flag)
+        run_tests_parallel(num_tracefiles, tracedir, tracefiles, mm_stats,
+                           &speed_params, jobs);
+    else
+        run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
+                  ranges, &speed_params);
 
 
     /* Display the mm results in a compact table */
@@ -430,6 +784,18 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_tracefiles, mm_stats);
             printf("\n");
+            if (latency_mode)
+                printlatency();
+            if (huge_pages)
+                printf("Heap on %s%s.\n\n",
+                       mem_hugepages() == MEM_HUGETLB_PAGES ? "hugetlb pages" :
+                       mem_hugepages() == MEM_TRANSPARENT_HUGE_PAGES ?
+                       "transparent huge pages" : "base pages, no huge pages",
+                       mm_stats[0].counts[CNT_DTLB] < 0 ?
+                       ", dTLB misses not counted (no perf_event access)" : "");
+            if (verbose > 1 && counters_errno != 0)
+                printf("Some hardware events were not counted: "
+                       "perf_event_open: %s.\n\n", strerror(counters_errno));
         }
     }
 
@@ -546,22 +912,69 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
  ****************************************************************/
 
+/* Free range records, linked through left */
+static range_t *range_pool = NULL;
+
+/* Treap priority of a range */
+static unsigned int range_priority(const range_t *p)
+{
+    return (unsigned int)((size_t)p->lo / ALIGNMENT) * 2654435761u;
+}
+
+/*
+ * range_merge - Join two trees where every range in the first lies
+ *     below every range in the second, and return the new root
+ */
+static range_t *range_merge(range_t *l, range_t *r)
+{
+    if (l == NULL)
+        return r;
+    if (r == NULL)
+        return l;
+    if (range_priority(l) > range_priority(r)) {
+        l->right = range_merge(l->right, r);
+        return l;
+    }
+    r->left = range_merge(l, r->left);
+    return r;
+}
+
+/*
+ * range_split - Split tree p into the ranges that start below lo,
+ *     left in *l, and the rest, left in *r
+ */
+static void range_split(range_t *p, char *lo, range_t **l, range_t **r)
+{
+    if (p == NULL) {
+        *l = *r = NULL;
+    }
+    else if (p->lo < lo) {
+        range_split(p->right, lo, &p->right, r);
+        *l = p;
+    }
+    else {
+        range_split(p->left, lo, l, &p->left);
+        *r = p;
+    }
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *below, *above;
+    int i;
 
     assert(size > 0);
 
@@ -572,42 +985,59 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within
+       one segment the allocator has mapped */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_mapped(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return 0;
     }
 
-    /* If we can't afford the linear-time loop, we check less thoroughly and
-       just assume the overlap will be caught by writing random bits. */
+    /* A trace may still opt out with its ignore-ranges flag, and rely
+       on the random bits to catch overlaps */
     if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
 
-
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            malloc_error(trace, opnum,
-                         "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                         lo, hi, p->lo, p->hi);
-            return 0;
+    /* The payloads in the tree never overlap, so only the last one
+       starting at or below hi can overlap this one */
+    for (p = *ranges, below = NULL;  p != NULL; ) {
+        if (p->lo <= hi) {
+            below = p;
+            p = p->right;
         }
+        else
+            p = p->left;
+    }
+    if (below != NULL && below->hi >= lo) {
+        malloc_error(trace, opnum,
+                     "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                     lo, hi, below->lo, below->hi);
+        return 0;
     }
 
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * by taking a range struct from the pool and adding it the range tree.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->next = *ranges;
+    if (range_pool == NULL) {
+        if ((p = (range_t *)malloc(RANGE_CHUNK * sizeof(range_t))) == NULL)
+            unix_error("malloc error in add_range");
+        for (i = 0; i < RANGE_CHUNK; i++) {
+            p[i].left = range_pool;
+            range_pool = &p[i];
+        }
+    }
+    p = range_pool;
+    range_pool = p->left;
     p->lo = lo;
     p->hi = hi;
+    p->left = p->right = NULL;
     p->index = index;
-    *ranges = p;
+
+    range_split(*ranges, lo, &below, &above);
+    *ranges = range_merge(range_merge(below, p), above);
 
     return 1;
 }
@@ -617,17 +1047,15 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    range_t *below, *p, *above;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    range_split(*ranges, lo, &below, &p);
+    range_split(p, lo + 1, &p, &above);
+    if (p != NULL) {
+        p->left = range_pool;
+        range_pool = p;
     }
+    *ranges = range_merge(below, above);
 }
 
 /*
@@ -635,14 +1063,26 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_t *p = *ranges;
+
+    if (p == NULL)
+        return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    p->left = range_pool;
+    range_pool = p;
+    *ranges = NULL;
+}
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+/*
+ * check_ranges - check the data of every block in the range tree
+ */
+static void check_ranges(const trace_t *trace, int opnum, range_t *ranges)
+{
+    for (; ranges != NULL; ranges = ranges->right) {
+        check_ranges(trace, opnum, ranges->left);
+        check_index(trace, opnum, ranges->index);
     }
-    *ranges = NULL;
 }
 
 /**********************************************
@@ -707,6 +1147,30 @@ static void check_index(const trace_t *trace, int opnum, int index) {
     }
 }
 
+/*
+ * check_size - Check that mm_usable_size gives block p room for the
+ * size bytes it was asked for and, if good is set, for the bytes
+ * mm_good_size promises a request of that size. Return 0 if not.
+ */
+static int check_size(const trace_t *trace, int opnum, char *p,
+                      size_t size, int good)
+{
+    size_t usable = mm_usable_size(p);
+
+    if (usable < size) {
+        malloc_error(trace, opnum, "mm_usable_size gives %zu bytes for a "
+                     "block of %zu.", usable, size);
+        return 0;
+    }
+    if (good && (mm_good_size(size) < size || mm_good_size(size) > usable)) {
+        malloc_error(trace, opnum, "mm_good_size gives %zu bytes for %zu, "
+                     "but the block holds %zu.", mm_good_size(size), size,
+                     usable);
+        return 0;
+    }
+    return 1;
+}
+
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
@@ -717,12 +1181,11 @@ static void check_index(const trace_t *trace, int opnum, int index) {
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
 {
-    FILE *tracefile;
+    FILE *tracefile = NULL;
     trace_t *trace;
-    char type[MAXLINE];
-    int index, size;
-    int max_index = 0;
-    int op_index;
+    char binname[MAXLINE];
+    struct stat repstat, binstat;
+    size_t len;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -730,17 +1193,35 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trace");
+    trace->map = NULL;
+    trace->map_len = 0;
 
-    /* Read the trace file header */
+    /* Read the trace file header, from a binary copy of a .rep file
+       instead when one is at least as new as the file */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
-    if ((tracefile = fopen(trace->filename, "r")) == NULL) {
-        unix_error("Could not open %s in read_trace", trace->filename);
+    len = strlen(trace->filename);
+    strcpy(binname, trace->filename);
+    if (len > 4 && strcmp(binname + len - 4, ".rep") == 0) {
+        strcpy(binname + len - 4, ".bin");
+        if (stat(trace->filename, &repstat) < 0 ||
+            stat(binname, &binstat) < 0 ||
+            binstat.st_mtime < repstat.st_mtime)
+            strcpy(binname, trace->filename);
+    }
+    if (map_trace(trace, binname)) {
+        if (verbose > 1)
+            printf("Mapped binary tracefile: %s\n", binname);
+    }
+    else {
+        if ((tracefile = fopen(trace->filename, "r")) == NULL) {
+            unix_error("Could not open %s in read_trace", trace->filename);
+        }
+        fscanf(tracefile, "%d", &trace->weight);
+        fscanf(tracefile, "%d", &trace->num_ids);
+        fscanf(tracefile, "%d", &trace->num_ops);
+        fscanf(tracefile, "%d", &trace->ignore_ranges);
     }
-    fscanf(tracefile, "%d", &trace->weight);
-    fscanf(tracefile, "%d", &trace->num_ids);
-    fscanf(tracefile, "%d", &trace->num_ops);
-    fscanf(tracefile, "%d", &trace->ignore_ranges);
 
     if(trace->weight < 0 || trace->weight > 3) {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
@@ -748,11 +1229,10 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if(trace->ignore_ranges != 0 && trace->ignore_ranges != 1) {
         app_error("%s: ignore-ranges can only be zero or one", trace->filename);
     }
-
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
+    if(trace->num_ids < 0 || trace->num_ids > MAX_IDS) {
+        app_error("%s: a trace can have at most %d ids", trace->filename,
+                  MAX_IDS);
+    }
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks =
@@ -769,6 +1249,34 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
          calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    /* A binary trace needs no parsing */
+    if (trace->map == NULL)
+        parse_trace(trace, tracefile);
+
+    /* fill in the stats */
+    strcpy(stats->filename, trace->filename);
+    stats->weight = trace->weight;
+    stats->ops = trace->num_ops;
+
+    return trace;
+}
+
+/*
+ * parse_trace - read the requests of a text trace file, whose header
+ *     has been read, and close it
+ */
+static void parse_trace(trace_t *trace, FILE *tracefile)
+{
+    traceop_t *ops;
+    char type[MAXLINE];
+    int index, size, align;
+    int max_index = 0;
+    int op_index;
+
+    /* We'll store each request line in the trace in this array */
+    if ((ops = (traceop_t *)calloc(trace->num_ops, sizeof(traceop_t))) == NULL)
+        unix_error("malloc 2 failed in read_trace");
+    trace->ops = ops;
 
     /* read every request line in the trace file */
     index = 0;
@@ -777,22 +1285,40 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         switch(type[0]) {
         case 'a':
             fscanf(tracefile, "%u %u", &index, &size);
-            trace->ops[op_index].type = ALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
+            ops[op_index].type = ALLOC;
+            ops[op_index].index = index;
+            ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'c':
+            fscanf(tracefile, "%u %u", &index, &size);
+            ops[op_index].type = CALLOC;
+            ops[op_index].index = index;
+            ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'm':
+            fscanf(tracefile, "%u %u %u", &index, &size, &align);
+            if (align <= 0 || (align & (align - 1)))
+                app_error("%s: alignment %d is not a power of two",
+                          trace->filename, align);
+            ops[op_index].type = MEMALIGN;
+            ops[op_index].index = index;
+            ops[op_index].size = size;
+            ops[op_index].align_log = __builtin_ctz(align);
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'r':
             fscanf(tracefile, "%u %u", &index, &size);
-            trace->ops[op_index].type = REALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
+            ops[op_index].type = REALLOC;
+            ops[op_index].index = index;
+            ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'f':
             fscanf(tracefile, "%ud", &index);
-            trace->ops[op_index].type = FREE;
-            trace->ops[op_index].index = index;
+            ops[op_index].type = FREE;
+            ops[op_index].index = index;
             break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n",
@@ -804,13 +1330,75 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+}
 
-    /* fill in the stats */
-    strcpy(stats->filename, trace->filename);
-    stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
+/*
+ * map_trace - map binary trace file filename, and point the header
+ *     fields and ops of trace into it. Return 0 if the file is not a
+ *     binary trace.
+ */
+static int map_trace(trace_t *trace, const char *filename)
+{
+    bintrace_t header;
+    struct stat st;
+    const traceop_t *op;
+    int fd, i;
 
-    return trace;
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header) ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, BINTRACE_MAGIC, sizeof(header.magic)) != 0) {
+        close(fd);
+        return 0;
+    }
+    if (header.num_ops < 0 || header.num_ids < 0 ||
+        header.num_ids > MAX_IDS || (size_t)st.st_size != sizeof(header) +
+        (size_t)header.num_ops * sizeof(traceop_t))
+        app_error("%s: binary trace is truncated", filename);
+
+    trace->map_len = st.st_size;
+    trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace->map == MAP_FAILED)
+        unix_error("mmap failed in map_trace");
+
+    trace->weight = header.weight;
+    trace->num_ids = header.num_ids;
+    trace->num_ops = header.num_ops;
+    trace->ignore_ranges = header.ignore_ranges;
+    trace->ops = (const traceop_t *)((char *)trace->map + sizeof(header));
+
+    /* The requests are used as they are, so only check their fields */
+    for (i = 0; i < trace->num_ops; i++) {
+        op = &trace->ops[i];
+        if (op->type > MEMALIGN || op->index >= trace->num_ids ||
+            op->index < (op->type == FREE ? -1 : 0))
+            app_error("%s: bad request %d in binary trace", filename, i);
+    }
+    return 1;
+}
+
+/*
+ * write_trace - write trace to filename as a binary trace
+ */
+static void write_trace(const trace_t *trace, const char *filename)
+{
+    bintrace_t header;
+    FILE *binfile;
+
+    memcpy(header.magic, BINTRACE_MAGIC, sizeof(header.magic));
+    header.weight = trace->weight;
+    header.num_ids = trace->num_ids;
+    header.num_ops = trace->num_ops;
+    header.ignore_ranges = trace->ignore_ranges;
+
+    if ((binfile = fopen(filename, "wb")) == NULL)
+        unix_error("Could not open %s in write_trace", filename);
+    if (fwrite(&header, sizeof(header), 1, binfile) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, binfile) !=
+        (size_t)trace->num_ops || fclose(binfile) != 0)
+        unix_error("Could not write %s in write_trace", filename);
 }
 
 /*
@@ -829,7 +1417,10 @@ static void reinit_trace(trace_t *trace)
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* unmap or free the four arrays... */
+        munmap(trace->map, trace->map_len);
+    else
+        free((void *)trace->ops);
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
@@ -841,6 +1432,68 @@ static void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * check_batch - Allocate BATCH_BLOCKS blocks at a time with
+ * mm_malloc_batch, check that they are aligned, apart and keep their
+ * data, and free them with mm_free_batch in a random order, in two
+ * halves, checking the heap after each. Return 0 if any of it fails.
+ */
+static int check_batch(trace_t *trace, range_t **ranges)
+{
+    static const size_t sizes[] = { 24, 200, 3000 };
+    char *blocks[BATCH_BLOCKS], *p;
+    size_t got, size, i, j, k;
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        size = sizes[k];
+        if ((got = mm_malloc_batch(size, BATCH_BLOCKS, (void **)blocks))
+            != BATCH_BLOCKS) {
+            malloc_error(trace, 0, "mm_malloc_batch gave %zu of %d blocks "
+                         "of %zu bytes.", got, BATCH_BLOCKS, size);
+            return 0;
+        }
+
+        /* Fill each block with its number, and check them all once
+           every one is filled, so an overlap shows even when the
+           range tree is off */
+        for (i = 0; i < BATCH_BLOCKS; i++) {
+            if (add_range(ranges, blocks[i], size, trace, 0, -1) == 0)
+                return 0;
+            memset(blocks[i], (int)i, size);
+        }
+        for (i = 0; i < BATCH_BLOCKS; i++) {
+            for (j = 0; j < size; j++) {
+                if (blocks[i][j] != (char)i) {
+                    malloc_error(trace, 0, "block %zu of a batch of %zu "
+                                 "bytes lost byte %zu.", i, size, j);
+                    return 0;
+                }
+            }
+            remove_range(ranges, blocks[i]);
+        }
+
+        /* Shuffle, so each half leaves gaps for the other and
+           mm_free_batch has to sort */
+        for (i = BATCH_BLOCKS - 1; i > 0; i--) {
+            j = random() % (i + 1);
+            p = blocks[i];
+            blocks[i] = blocks[j];
+            blocks[j] = p;
+        }
+        for (i = 0; i < BATCH_BLOCKS; i += BATCH_BLOCKS / 2) {
+            mm_free_batch((void **)&blocks[i], BATCH_BLOCKS / 2);
+            if (mm_checkheap(0) != 0) {
+                malloc_error(trace, 0, "mm_checkheap found the heap "
+                             "inconsistent after mm_free_batch of %zu "
+                             "byte blocks.", size);
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -848,12 +1501,12 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 {
     int i;
     int index;
-    size_t size;
+    size_t size, j;
     char *newp;
     char *oldp;
     char *p;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
     reinit_trace(trace);
@@ -864,23 +1517,43 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         return 0;
     }
 
+    /* A calloc whose size overflows must fail rather than return
+       a small block */
+    if (mm_calloc((size_t)-1 / 2 + 2, 2) != NULL) {
+        malloc_error(trace, 0, "mm_calloc did not fail on an overflowing "
+                     "size.");
+        return 0;
+    }
+
+    /* posix_memalign takes only powers of two, and leaves the
+       pointer alone when it fails */
+    p = NULL;
+    if (mm_posix_memalign((void **)&p, 3 * sizeof(void *), 1) != EINVAL ||
+        p != NULL) {
+        malloc_error(trace, 0, "mm_posix_memalign did not reject an "
+                     "alignment that is not a power of two.");
+        return 0;
+    }
+
+    /* Blocks allocated and freed in batches must be sound */
+    if (check_batch(trace, ranges) == 0)
+        return 0;
+
     /* Interpret each operation in the trace in order */
     for (i = 0;  i < trace->num_ops;  i++) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
         if(debug_mode == DBG_EXPENSIVE) {
-            range_t *r;
-                        
             /* Let the students check their own heap */
-            mm_checkheap(verbose);
+            if (mm_checkheap(verbose) != 0) {
+                malloc_error(trace, i, "mm_checkheap found the heap "
+                             "inconsistent.");
+                return 0;
+            }
 
             /* Now check that all our allocated blocks have the right data */
-            r = *ranges;
-            while(r) {
-                check_index(trace, i, r->index);
-                r = r->next;
-            }
+            check_ranges(trace, i, *ranges);
         }
 
         switch (trace->ops[i].type) {
@@ -895,12 +1568,74 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
             /*
              * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
+             * to the range tree if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
             if (add_range(ranges, p, size, trace, i, index) == 0)
                 return 0;
 
+            /* The block must hold what was asked for, and what
+               mm_good_size says a request of that size gets */
+            if (check_size(trace, i, p, size, 1) == 0)
+                return 0;
+
+            /* Remember region */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            /* Set to random data, for debugging. */
+            randomize_block(trace, index);
+            break;
+
+        case CALLOC: /* mm_calloc */
+
+            /* Call the student's calloc */
+            if ((p = mm_calloc(1, size)) == NULL) {
+                malloc_error(trace, i, "mm_calloc failed.");
+                return 0;
+            }
+
+            /* Same checks as for malloc, and the block must be cleared */
+            if (add_range(ranges, p, size, trace, i, index) == 0)
+                return 0;
+            if (check_size(trace, i, p, size, 1) == 0)
+                return 0;
+            for (j = 0; j < size; j++) {
+                if (p[j] != 0) {
+                    malloc_error(trace, i, "mm_calloc left byte %zu of the "
+                                 "block set.", j);
+                    return 0;
+                }
+            }
+
+            /* Remember region */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            /* Set to random data, for debugging. */
+            randomize_block(trace, index);
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+
+            /* Call the student's memalign */
+            if ((p = mm_memalign(OP_ALIGN(trace->ops[i]), size)) == NULL) {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return 0;
+            }
+
+            /* Same checks as for malloc, and the payload must have
+               the alignment asked for */
+            if ((size_t)p % OP_ALIGN(trace->ops[i]) != 0) {
+                malloc_error(trace, i, "Payload address (%p) not aligned "
+                             "to %zu bytes", p, OP_ALIGN(trace->ops[i]));
+                return 0;
+            }
+            if (add_range(ranges, p, size, trace, i, index) == 0)
+                return 0;
+            if (check_size(trace, i, p, size, 0) == 0)
+                return 0;
+
             /* Remember region */
             trace->blocks[index] = p;
             trace->block_sizes[index] = size;
@@ -926,13 +1661,15 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             }
 
 
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range tree */
             remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range tree */
             if (size > 0) {
                 if(add_range(ranges, newp, size, trace, i, index) == 0)
                     return 0;
+                if (check_size(trace, i, newp, size, 0) == 0)
+                    return 0;
             }
 
 
@@ -952,14 +1689,20 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         case FREE: /* mm_free */
             check_index(trace, i, index);
 
-            /* Remove region from list and call student's free function */
+            /* Remove region from tree and call student's free function */
             if(index == -1) {
-                p = 0;
+                mm_free(0);
             } else {
                 p = trace->blocks[index];
                 remove_range(ranges, p);
+
+                /* The size is known here, so free by it, after
+                   checking that it is one mm_free_sized takes */
+                if (check_size(trace, i, p, trace->block_sizes[index], 0)
+                    == 0)
+                    return 0;
+                mm_free_sized(p, trace->block_sizes[index]);
             }
-            mm_free(p);
             break;
 
         default:
@@ -976,11 +1719,12 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   Utilization is the ratio hwm/peaksize, where peaksize is the
+ *   most bytes the heap and the segments mapped by the student's
+ *   malloc package held at once while running the trace. Note that
+ *   our implementation of mem_sbrk() doesn't allow the students to
+ *   decrement the brk pointer, so brk is always the high water mark
+ *   of the heap.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1005,10 +1749,14 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            if ((p = trace->ops[i].type == ALLOC ? mm_malloc(size) :
+                 trace->ops[i].type == CALLOC ? mm_calloc(1, size) :
+                 mm_memalign(OP_ALIGN(trace->ops[i]), size)) == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1065,7 +1813,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
     printf(".");
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* Memory taken is the most the heap and any mapped segments
+       ever held at once */
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
@@ -1097,6 +1847,22 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_calloc(1, size)) == NULL)
+                app_error("mm_calloc error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(OP_ALIGN(trace->ops[i]), size)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1130,6 +1896,7 @@ static void eval_mm_speed(void *ptr)
 static int eval_libc_valid(trace_t *trace)
 {
     int i, newsize;
+    size_t align;
     char *p, *newp, *oldp;
 
     reinit_trace(trace);
@@ -1145,6 +1912,26 @@ static int eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case CALLOC: /* calloc */
+            if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+                malloc_error(trace, i, "libc calloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
+        case MEMALIGN: /* posix_memalign, which takes no less than
+                          the alignment of a pointer */
+            align = OP_ALIGN(trace->ops[i]);
+            if (align < sizeof(void *))
+                align = sizeof(void *);
+            if (posix_memalign((void **)&p, align, trace->ops[i].size) != 0) {
+                malloc_error(trace, i, "libc posix_memalign failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1180,6 +1967,7 @@ static void eval_libc_speed(void *ptr)
 {
     int i;
     int index, size, newsize;
+    size_t align;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -1195,6 +1983,25 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case CALLOC: /* calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = calloc(1, size)) == NULL)
+                unix_error("calloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* posix_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            align = OP_ALIGN(trace->ops[i]);
+            if (align < sizeof(void *))
+                align = sizeof(void *);
+            if (posix_memalign((void **)&p, align, size) != 0)
+                unix_error("posix_memalign failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1218,6 +2025,195 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/*
+ * count_events - Run f once, and set each of counts to the number of
+ *    times its hardware event happened in user mode, or to -1 if the
+ *    kernel would not count it. Events the PMU had to multiplex are
+ *    scaled up to the whole run. If no event can be counted, f is not
+ *    run at all.
+ */
+static void count_events(void (*f)(void *), void *argp, double *counts)
+{
+    struct perf_event_attr attr;
+    unsigned long long value[3]; /* count, time enabled, time running */
+    int fds[NCOUNTERS];
+    int i, opened = 0;
+
+    for (i = 0; i < NCOUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] < 0)
+            counters_errno = errno;
+        else
+            opened++;
+    }
+
+    /* Nothing to count, so save replaying the trace */
+    if (opened == 0) {
+        for (i = 0; i < NCOUNTERS; i++)
+            counts[i] = -1;
+        return;
+    }
+
+    for (i = 0; i < NCOUNTERS; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+    for (i = 0; i < NCOUNTERS; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    f(argp);
+    for (i = 0; i < NCOUNTERS; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < NCOUNTERS; i++) {
+        counts[i] = -1;
+        if (fds[i] < 0)
+            continue;
+        if (read(fds[i], value, sizeof(value)) == sizeof(value) &&
+            value[2] > 0)
+            counts[i] = (double)value[0] * value[1] / value[2];
+        close(fds[i]);
+    }
+}
+
+/*
+ * latency_bucket - Return the histogram bucket of a latency of v cycles
+ */
+static int latency_bucket(unsigned long long v)
+{
+    int e;
+
+    if (v < LAT_SUB)
+        return v;
+    e = 63 - __builtin_clzll(v);      /* 2^e <= v < 2^(e+1) */
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB +
+        (int)((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/*
+ * latency_value - Return the highest latency in cycles that falls in
+ *    bucket b
+ */
+static unsigned long long latency_value(int b)
+{
+    int k = b / LAT_SUB;
+
+    if (k == 0)
+        return b;
+    return ((unsigned long long)(LAT_SUB + b % LAT_SUB + 1) << (k - 1)) - 1;
+}
+
+/*
+ * latency_ns - Return the latency in ns that fraction q of the ops in
+ *    h took no longer than, or their longest latency if q is 1
+ */
+static double latency_ns(const latency_t *h, double q)
+{
+    unsigned long target = (unsigned long)(q * h->n + 0.999999);
+    unsigned long seen = 0;
+    unsigned long long v = h->max;
+    int b;
+
+    if (q < 1) {
+        for (b = 0; b < LAT_BUCKETS; b++) {
+            seen += h->count[b];
+            if (seen >= target && seen > 0)
+                break;
+        }
+        v = latency_value(b);
+        if (v > h->max)
+            v = h->max;
+    }
+    return v * 1e3 / latency_mhz;
+}
+
+/* latency_add - Count one op of v cycles in h */
+static void latency_add(latency_t *h, unsigned long long v)
+{
+    h->count[latency_bucket(v)]++;
+    h->n++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/*
+ * eval_mm_latency - Run the trace once more, reading the cycle counter
+ *    around every request, and fill in the latency percentiles of
+ *    stats. The ops also go into the histograms by type and size class.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    static latency_t all;
+    unsigned long long start, cycles;
+    int i, index, cls;
+    size_t size, limit;
+    char *p;
+
+    memset(&all, 0, sizeof(all));
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        p = NULL;
+
+        start = read_counter();
+        switch (trace->ops[i].type) {
+        case ALLOC:
+            p = mm_malloc(size);
+            break;
+        case CALLOC:
+            p = mm_calloc(1, size);
+            break;
+        case MEMALIGN:
+            p = mm_memalign(OP_ALIGN(trace->ops[i]), size);
+            break;
+        case REALLOC:
+            p = mm_realloc(trace->blocks[index], size);
+            break;
+        case FREE:
+            mm_free(index < 0 ? NULL : trace->blocks[index]);
+            break;
+        }
+        cycles = read_counter() - start;
+        cycles = cycles > latency_ovhd ? cycles - latency_ovhd : 0;
+
+        if (trace->ops[i].type == FREE) {
+            size = index < 0 ? 0 : trace->block_sizes[index];
+        }
+        else {
+            if (p == NULL && size != 0)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+        }
+
+        for (cls = 0, limit = 16; cls < LAT_SIZE_CLASSES - 1 && size > limit;
+             cls++, limit *= 4)
+            ;
+        latency_add(&all, cycles);
+        latency_add(&latency_by_type[trace->ops[i].type], cycles);
+        latency_add(&latency_by_class[cls], cycles);
+    }
+
+    stats->lat[0] = latency_ns(&all, 0.5);
+    stats->lat[1] = latency_ns(&all, 0.99);
+    stats->lat[2] = latency_ns(&all, 0.999);
+    stats->lat[3] = latency_ns(&all, 1);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1233,14 +2229,34 @@ static void printresults(int n, stats_t *stats)
     double sumsecs = 0;
     double sumops  = 0;
     double sumutil = 0;
+    double sumcounts[NCOUNTERS] = { 0 };
+    double sumcountops[NCOUNTERS] = { 0 };
     int sum_perf_weight = 0;
     int sum_util_weight = 0;
+    int show_count[NCOUNTERS] = { 0 };
+    int show_latency = 0;
+    int c;
 
     char wstr;
 
+    /* Each hardware event per op gets a column when it could be
+       counted, and so do op latencies when they were measured */
+    for (i=0; i < n; i++) {
+        for (c = 0; c < NCOUNTERS; c++)
+            if (stats[i].valid && stats[i].counts[c] >= 0)
+                show_count[c] = 1;
+        if (stats[i].valid && stats[i].lat[3] > 0)
+            show_latency = 1;
+    }
+
     /* Print the individual results for each trace */
-    printf("  %2s%6s %5s%8s%9s  %s\n",
-           "valid", "util", "ops", "secs", "Kops", "trace");
+    printf("  %2s%6s %5s%8s%9s", "valid", "util", "ops", "secs", "Kops");
+    for (c = 0; c < NCOUNTERS; c++)
+        if (show_count[c])
+            printf("%8s", counters[c].name);
+    if (show_latency)
+        printf("%7s%7s%7s%8s", "p50", "p99", "p99.9", "max");
+    printf("  %s\n", "trace");
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
             switch(stats[i].weight)
@@ -1282,6 +2298,19 @@ static void printresults(int n, stats_t *stats)
             else
                 printf("%8s%10s%6s", "--", "--", "--");
 
+            for (c = 0; c < NCOUNTERS; c++) {
+                if (show_count[c] && stats[i].counts[c] >= 0)
+                    printf(counters[c].fmt, stats[i].counts[c]/stats[i].ops);
+                else if (show_count[c])
+                    printf("%8s", "--");
+            }
+
+            if (show_latency && stats[i].lat[3] > 0)
+                printf("%7.0f%7.0f%7.0f%8.0f", stats[i].lat[0],
+                       stats[i].lat[1], stats[i].lat[2], stats[i].lat[3]);
+            else if (show_latency)
+                printf("%7s%7s%7s%8s", "--", "--", "--", "--");
+
             printf(" %s\n", stats[i].filename);
 
             if(stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1289,6 +2318,12 @@ static void printresults(int n, stats_t *stats)
                     sum_perf_weight += 1;
                     sumsecs += stats[i].secs;
                     sumops += stats[i].ops;
+                    for (c = 0; c < NCOUNTERS; c++) {
+                        if (stats[i].counts[c] >= 0) {
+                            sumcounts[c] += stats[i].counts[c];
+                            sumcountops[c] += stats[i].ops;
+                        }
+                    }
                 }
             if(stats[i].weight == WALL || stats[i].weight == WUTIL)
                 {
@@ -1297,14 +2332,19 @@ static void printresults(int n, stats_t *stats)
                 }
         }
         else {
-            printf("%2s%4s %6s%8s%10s%6s %s\n",
+            printf("%2s%4s %6s%8s%10s%6s",
                    stats[i].weight != 0 ? "*" : "",
                    "no",
                    "-",
                    "-",
                    "-",
-                   "-",
-                   stats[i].filename);
+                   "-");
+            for (c = 0; c < NCOUNTERS; c++)
+                if (show_count[c])
+                    printf("%8s", "-");
+            if (show_latency)
+                printf("%7s%7s%7s%8s", "-", "-", "-", "-");
+            printf(" %s\n", stats[i].filename);
         }
     }
 
@@ -1313,13 +2353,18 @@ static void printresults(int n, stats_t *stats)
         if(sum_perf_weight == 0) sum_perf_weight = 1;
         if(sum_util_weight == 0) sum_util_weight = 1;
 
-        printf("%2d %2d  %5.0f%%%8.0f%10.6f%6.0f\n",
+        printf("%2d %2d  %5.0f%%%8.0f%10.6f%6.0f",
                sum_util_weight,
                sum_perf_weight,
                (sumutil/(double)sum_util_weight)*100.0,
                sumops,
                sumsecs,
                (sumsecs==0.0) ? 0 : (sumops/1e3)/sumsecs);
+        for (c = 0; c < NCOUNTERS; c++)
+            if (show_count[c])
+                printf(counters[c].fmt, (sumcountops[c]==0.0) ? 0 :
+                       sumcounts[c]/sumcountops[c]);
+        printf("\n");
     }
     else {
         printf("     %8s%10s%6s\n",
@@ -1330,6 +2375,47 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printlatency - prints the op latency percentiles, by request type
+ *    and by request size, over all the traces timed (-L)
+ */
+static void printlatency(void)
+{
+    static const char *names[LAT_TYPES] = {
+        [ALLOC] = "malloc", [FREE] = "free", [REALLOC] = "realloc",
+        [CALLOC] = "calloc", [MEMALIGN] = "memalign"
+    };
+    static const int order[LAT_TYPES] = {
+        ALLOC, CALLOC, MEMALIGN, REALLOC, FREE
+    };
+    const latency_t *h;
+    char name[16];
+    int i;
+
+    printf("Latency in ns:\n");
+    printf("%-10s%9s%7s%7s%7s%8s\n", "request", "ops", "p50", "p99",
+           "p99.9", "max");
+    for (i = 0; i < LAT_TYPES + LAT_SIZE_CLASSES; i++) {
+        if (i < LAT_TYPES) {
+            h = &latency_by_type[order[i]];
+            strcpy(name, names[order[i]]);
+        }
+        else {
+            h = &latency_by_class[i - LAT_TYPES];
+            if (i - LAT_TYPES < LAT_SIZE_CLASSES - 1)
+                sprintf(name, "<= %d", 16 << 2 * (i - LAT_TYPES));
+            else
+                sprintf(name, "> %d", 16 << 2 * (i - LAT_TYPES - 1));
+        }
+        if (h->n == 0)
+            continue;
+        printf("%-10s%9lu%7.0f%7.0f%7.0f%8.0f\n", name, h->n,
+               latency_ns(h, 0.5), latency_ns(h, 0.99),
+               latency_ns(h, 0.999), latency_ns(h, 1));
+    }
+    printf("\n");
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1375,16 +2461,21 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlLVdDH] [-f <file>] [-w <file>] [-T <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Give back the pages of free blocks of <n> bytes or more.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Check <n> traces at once, then time them one by one.\n");
+    fprintf(stderr, "\t-H         Back the heap with huge pages.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report latency percentiles of every request.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-w <file>  Write the -f trace to <file> as a binary trace.\n");
 }
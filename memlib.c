@@ -3,6 +3,7 @@
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
  */
+#define _GNU_SOURCE		/* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -12,54 +13,183 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+#ifdef DRIVER
+/* Most segments there can be mapped at once */
+#define MAX_MAPS 4096
+#endif
+
 /* private variables */
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static char *mem_clean;			/* Heap from here on reads as zeros */
+static size_t peak_bytes;		/* High water mark of heap plus segments */
+static size_t heap_len;			/* Length of the heap mapping */
+static size_t heap_page;		/* Size of the pages backing the heap */
+static int huge_pages = HUGE_PAGES;	/* Whether to ask for huge pages */
+static int heap_backing;		/* MEM_xxx_PAGES the heap got */
+
+/* The mapped segments, guarded by map_lock. Only the driver keeps
+ * them, to check blocks against and to count in peak_bytes, so the
+ * library build maps and unmaps with no table to search or lock to
+ * take, and mapped_bytes stays 0. */
+#ifdef DRIVER
+static struct {
+	char *start;
+	size_t size;
+} maps[MAX_MAPS];
+static int nmaps;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static size_t mapped_bytes;
+
+/*
+ * map_huge - map the heap on huge pages: reserved hugetlb pages if
+ *		the system has enough for all of it, and otherwise memory
+ *		aligned to a huge page that the kernel is asked to back with
+ *		transparent huge pages. Returns MAP_FAILED if neither works.
+ */
+static char *map_huge(void) {
+	size_t len = (MAX_HEAP + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	char *map, *start;
+
+	// Without MAP_NORESERVE the pages are reserved up front, so a
+	// fault cannot find the pool empty later
+	map = mmap((void *)0x800000000, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (map != MAP_FAILED) {
+		heap_len = len;
+		heap_page = HUGE_PAGE_SIZE;
+		heap_backing = MEM_HUGETLB_PAGES;
+		return map;
+	}
+
+	map = mmap((void *)0x800000000, len + HUGE_PAGE_SIZE,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		return MAP_FAILED;
+
+	// Cut off what lies before and after the aligned heap
+	start = (char *)(((size_t)map + HUGE_PAGE_SIZE - 1) &
+			~(HUGE_PAGE_SIZE - 1));
+	if (start > map)
+		munmap(map, start - map);
+	munmap(start + len, map + HUGE_PAGE_SIZE - start);
+
+	heap_len = len;
+	if (madvise(start, len, MADV_HUGEPAGE) == 0)
+		heap_backing = MEM_TRANSPARENT_HUGE_PAGES;
+	return start;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void){
-	int dev_zero = open("/dev/zero", O_RDWR);
-	heap = mmap((void *)0x800000000, /* suggested start*/
-			MAX_HEAP,				/* length */
-			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
-			dev_zero,				/* fd */
-			0);						/* offset (dunno) */
+	heap_page = mem_pagesize();
+	heap_backing = MEM_SMALL_PAGES;
+	heap = huge_pages ? map_huge() : MAP_FAILED;
+	if (heap == MAP_FAILED) {
+		int dev_zero = open("/dev/zero", O_RDWR);
+		heap = mmap((void *)0x800000000, /* suggested start*/
+				MAX_HEAP,				/* length */
+				PROT_WRITE,				/* permissions */
+				MAP_PRIVATE | MAP_NORESERVE, /* private or shared? */
+				dev_zero,				/* fd */
+				0);						/* offset (dunno) */
+		heap_len = MAX_HEAP;
+	}
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+	mem_clean = heap;
 }
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
-	munmap(heap, MAX_HEAP);
+	munmap(heap, heap_len);
+}
+
+/*
+ * mem_set_hugepages - ask for huge pages behind the heap, or not, from
+ *		the next mem_init on
+ */
+void mem_set_hugepages(int on) {
+	huge_pages = on;
+}
+
+/*
+ * mem_hugepages - returns the kind of pages behind the heap, one of
+ *		the MEM_xxx_PAGES constants
+ */
+int mem_hugepages(void) {
+	return heap_backing;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *		and unmap every segment
  */
 void mem_reset_brk(){
+#ifdef DRIVER
+	pthread_mutex_lock(&map_lock);
+	while (nmaps > 0) {
+		nmaps--;
+		munmap(maps[nmaps].start, maps[nmaps].size);
+	}
+	mapped_bytes = 0;
+	pthread_mutex_unlock(&map_lock);
+#endif
+
 	mem_brk = heap;
+	peak_bytes = 0;
+}
+
+/*
+ * page_up - round p up to the start of a page
+ */
+static char *page_up(char *p) {
+	return (char *)(((size_t)p + heap_page - 1) & ~(heap_page - 1));
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area.
+ *		A negative incr shrinks the heap, and the pages past the new
+ *		brk go back to the system.
  */
-void *mem_sbrk(int incr) {
+void *mem_sbrk(intptr_t incr) {
 	char *old_brk = mem_brk;
 
+	if (incr < 0) {
+		if (-incr > mem_brk - heap) {
+			errno = ENOMEM;
+			fprintf(stderr, "ERROR: mem_sbrk failed. Shrank past the heap...\n");
+			return (void *)-1;
+		}
+		// The real brk is left alone, since libc may have moved it
+		// since we grew it.
+		mem_brk += incr;
+		if (mem_clean <= page_up(old_brk)) {
+			// Nothing past the page of old_brk was written, so
+			// release that page too, and if that works all from
+			// the page after the new brk is clean
+			if (mem_release(mem_brk, page_up(old_brk) - mem_brk))
+				mem_clean = page_up(mem_brk);
+		} else
+			mem_release(mem_brk, -incr);
+		return (void *)old_brk;
+	}
+
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
+	if ( (incr > mem_max_addr - mem_brk) ||
             sbrk(incr) == (void *) -1) {
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
@@ -67,6 +197,10 @@ void *mem_sbrk(int incr) {
 	}
 
 	mem_brk += incr;
+	if (mem_brk > mem_clean)
+		mem_clean = mem_brk;
+	if (mem_heapsize() + mapped_bytes > peak_bytes)
+		peak_bytes = mem_heapsize() + mapped_bytes;
 	return (void *)old_brk;
 }
 
@@ -84,6 +218,15 @@ void *mem_heap_hi(){
 	return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_heap_clean - returns the address from which the heap has never
+ *		been written since it was made, or has been released, and so
+ *		reads as zeros up to its largest size
+ */
+void *mem_heap_clean() {
+	return (void *)mem_clean;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -97,3 +240,213 @@ size_t mem_heapsize() {
 size_t mem_pagesize(){
 	return (size_t)getpagesize();
 }
+
+#ifdef DRIVER
+/*
+ * mapfind - return the index of the mapping starting at ptr, or -1.
+ *		Called with map_lock held.
+ */
+static int mapfind(void *ptr) {
+	int i;
+
+	for (i = 0; i < nmaps; i++)
+		if (maps[i].start == ptr)
+			return i;
+	return -1;
+}
+
+/*
+ * mapnote - remember that the high water mark may have moved.
+ *		Called with map_lock held.
+ */
+static void mapnote(void) {
+	size_t total = mem_heapsize() + mapped_bytes;
+
+	if (total > peak_bytes)
+		peak_bytes = total;
+}
+
+/*
+ * mapadd - enter the segment of size bytes at seg in the table.
+ *		Returns 0 if MAX_MAPS segments are already mapped.
+ */
+static int mapadd(char *seg, size_t size) {
+	pthread_mutex_lock(&map_lock);
+	if (nmaps == MAX_MAPS) {
+		pthread_mutex_unlock(&map_lock);
+		return 0;
+	}
+	maps[nmaps].start = seg;
+	maps[nmaps].size = size;
+	nmaps++;
+	mapped_bytes += size;
+	mapnote();
+	pthread_mutex_unlock(&map_lock);
+	return 1;
+}
+
+/*
+ * mapdel - take the segment at ptr out of the table
+ */
+static void mapdel(void *ptr) {
+	int i;
+
+	pthread_mutex_lock(&map_lock);
+	if ((i = mapfind(ptr)) >= 0) {
+		mapped_bytes -= maps[i].size;
+		maps[i] = maps[--nmaps];
+	}
+	pthread_mutex_unlock(&map_lock);
+}
+
+/*
+ * mapmove - note that the segment at ptr is now size bytes at seg
+ */
+static void mapmove(void *ptr, char *seg, size_t size) {
+	int i;
+
+	pthread_mutex_lock(&map_lock);
+	if ((i = mapfind(ptr)) >= 0) {
+		mapped_bytes += size - maps[i].size;
+		maps[i].start = seg;
+		maps[i].size = size;
+		mapnote();
+	}
+	pthread_mutex_unlock(&map_lock);
+}
+#else
+static int mapadd(char *seg, size_t size) {
+	(void)seg;
+	(void)size;
+	return 1;
+}
+
+static void mapdel(void *ptr) {
+	(void)ptr;
+}
+
+static void mapmove(void *ptr, char *seg, size_t size) {
+	(void)ptr;
+	(void)seg;
+	(void)size;
+}
+#endif
+
+/*
+ * mem_map - map a new segment of size bytes, filled with zeros and
+ *		aligned to align bytes, a power of two, or to a page if align is
+ *		smaller. Segments lie outside the heap, and are counted by
+ *		mem_mapsize. Those aligned to a huge page get transparent huge
+ *		pages along with the heap. Returns NULL on failure, or in the
+ *		driver if MAX_MAPS segments are already mapped.
+ */
+void *mem_map(size_t size, size_t align) {
+	size_t page = mem_pagesize();
+	size_t len;
+	char *map, *seg;
+
+	size = (size + page - 1) & ~(page - 1);
+	if (align < page)
+		align = page;
+	len = size + (align > page ? align : 0);
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	// Cut off what lies before and after the aligned segment
+	seg = (char *)(((size_t)map + align - 1) & ~(align - 1));
+	if (seg > map)
+		munmap(map, seg - map);
+	if (seg + size < map + len)
+		munmap(seg + size, map + len - (seg + size));
+
+	if (!mapadd(seg, size)) {
+		munmap(seg, size);
+		return NULL;
+	}
+	if (huge_pages && align >= HUGE_PAGE_SIZE)
+		madvise(seg, size, MADV_HUGEPAGE);
+
+	return (void *)seg;
+}
+
+/*
+ * mem_unmap - unmap a segment of size bytes returned by mem_map
+ */
+void mem_unmap(void *ptr, size_t size) {
+	mapdel(ptr);
+	munmap(ptr, size);
+}
+
+/*
+ * mem_remap - resize the segment at ptr from oldsize to newsize bytes,
+ *		moving it if need be, without copying its contents. Returns the
+ *		new address, or NULL on failure, leaving the segment as it was.
+ */
+void *mem_remap(void *ptr, size_t oldsize, size_t newsize) {
+	size_t page = mem_pagesize();
+	char *seg;
+
+	newsize = (newsize + page - 1) & ~(page - 1);
+	seg = mremap(ptr, oldsize, newsize, MREMAP_MAYMOVE);
+	if (seg == MAP_FAILED)
+		return NULL;
+
+	mapmove(ptr, seg, newsize);
+	return (void *)seg;
+}
+
+/*
+ * mem_release - give the whole pages among the size bytes at ptr back
+ *		to the system. They stay mapped, and read as zeros when next
+ *		touched. In a heap on hugetlb pages, only whole huge pages go.
+ *		Returns 0 if the system refused them, as older kernels do for
+ *		hugetlb pages, so that they keep what was written to them,
+ *		and 1 otherwise.
+ */
+int mem_release(void *ptr, size_t size) {
+	size_t page = (char *)ptr >= heap && (char *)ptr < mem_max_addr ?
+		heap_page : mem_pagesize();
+	size_t lo = ((size_t)ptr + page - 1) & ~(page - 1);
+	size_t hi = ((size_t)ptr + size) & ~(page - 1);
+
+	if (lo < hi && madvise((void *)lo, hi - lo, MADV_DONTNEED) != 0)
+		return 0;
+	return 1;
+}
+
+#ifdef DRIVER
+/*
+ * mem_mapped - return whether the bytes lo to hi lie in one segment
+ *		returned by mem_map
+ */
+int mem_mapped(const void *lo, const void *hi) {
+	int i, found = 0;
+
+	pthread_mutex_lock(&map_lock);
+	for (i = 0; i < nmaps && !found; i++)
+		found = (char *)lo >= maps[i].start &&
+			(char *)hi < maps[i].start + maps[i].size;
+	pthread_mutex_unlock(&map_lock);
+
+	return found;
+}
+#endif
+
+/*
+ * mem_mapsize - returns the number of bytes in mapped segments, which
+ *		only the driver build counts
+ */
+size_t mem_mapsize(void) {
+	return mapped_bytes;
+}
+
+/*
+ * mem_peaksize - returns the largest number of bytes the heap and the
+ *		mapped segments have taken together since the heap was last reset
+ */
+size_t mem_peaksize(void) {
+	return peak_bytes;
+}
@@ -1,11 +1,29 @@
+#include <stdint.h>
 #include <unistd.h>
 
+/* Kinds of pages behind the heap */
+#define MEM_SMALL_PAGES            0
+#define MEM_TRANSPARENT_HUGE_PAGES 1
+#define MEM_HUGETLB_PAGES          2
+
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void mem_set_hugepages(int on);
+int mem_hugepages(void);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_clean(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+void *mem_map(size_t size, size_t align);
+void mem_unmap(void *ptr, size_t size);
+void *mem_remap(void *ptr, size_t oldsize, size_t newsize);
+int mem_release(void *ptr, size_t size);
+#ifdef DRIVER
+int mem_mapped(const void *lo, const void *hi);
+#endif
+size_t mem_mapsize(void);
+size_t mem_peaksize(void);
 
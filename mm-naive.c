@@ -142,7 +142,8 @@ void *calloc (size_t nmemb, size_t size)
  * mm_checkheap - There are no bugs in my code, so I don't need to check,
  *      so nah!
  */
-void mm_checkheap(int verbose){
+int mm_checkheap(int verbose){
 	/*Get gcc to be quiet. */
 	verbose = verbose;
+	return 0;
 }
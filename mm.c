@@ -6,17 +6,64 @@
  * This is a 32-bit and 64-bit allocator based on
  * segregated lists, with a total of 16 lists, 
  * first fit placement and boundary tag coalescing.
- * Blocks are aligned to double word boundaries.
+ * Blocks are aligned to double word boundaries; for larger
+ * alignments, the slack ahead of the payload becomes a free block.
+ *
+ * The lists for blocks larger than 4 KB are kept as
+ * treaps ordered by size and then address, giving O(log n)
+ * best fit placement for large blocks.
+ *
+ * Optionally, requests of up to 64 bytes are served from 4 KB runs of
+ * fixed size slots with no per-object header. A run is an
+ * ordinary allocated block, aligned so that the run holding a
+ * slot is found by masking the slot address, and a bitmap
+ * indexed by run address tells slots apart from blocks on free.
+ * This layer is built with -DUSE_SLAB=1.
+ *
+ * Building without -DDRIVER gives malloc, free, realloc and
+ * calloc themselves, and turns on USE_THREADS: threads are then
+ * spread over up to MAX_ARENAS arenas, each a heap with its own
+ * lists and lock, blocks are freed to the arena that owns them,
+ * and each thread keeps a small cache of free blocks per size that
+ * serves hot sizes with no locking.
+ *
+ * Freed blocks of up to 64 bytes are not coalesced at once but kept
+ * in a LIFO bin per size, the fast bins, for the next request of
+ * that size. The bins are coalesced into the lists in one pass when
+ * a large request comes, when nothing fits, or when they hold too
+ * many bytes. The driver build coalesces every free unless built
+ * with -DUSE_FASTBINS=1.
+ *
+ * Requests of mmapThreshold bytes or more get a mapping of their
+ * own, which goes back to the system as soon as it is freed and
+ * grows by remapping rather than copying. Freed memory also goes
+ * back from the heap: a free last block of trimThreshold bytes or
+ * more is cut down to half that, and the pages inside other free
+ * blocks that large are released.
+ *
+ * Building with -DUSE_TLSF=1 replaces the 16 lists with a
+ * two-level segregated fit (TLSF) index, which gives O(1)
+ * good fit placement at the cost of a larger list header.
+ * Building with -DUSE_ADDRESS_ORDER=1 keeps the small block lists
+ * sorted by address instead of last in, first out.
+ *
+ * Headers, footers and free list links are 32-bit words. Links
+ * count double words from the start of the heap rather than bytes,
+ * so a heap may reach 32 GB, in blocks of up to 4 GB each. Building
+ * with -DUSE_WIDE_HEADERS=1 makes them 64-bit, for larger blocks.
  *
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /* If you want debugging output, use the following macro.  
  * When you hand in, remove the #define DEBUG line. */
@@ -27,6 +74,9 @@
 # define dbg_printf(...)
 #endif
 
+/* Print a problem checkheap found, and count it for mm_checkheap */
+#define heap_error(...) (heapErrors++, printf(__VA_ARGS__))
+
 
 /* do not change the following! */
 #ifdef DRIVER
@@ -35,6 +85,9 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #endif /* def DRIVER */
 
 /* single word (4) or double word (8) alignment */
@@ -45,24 +98,55 @@
 
 
 /* $begin mallocmacros */
+/* Use 64-bit headers, footers and free list links: 1 on, 0 off.
+ * Off by default, since 32-bit words already reach blocks of up
+ * to 4 GB in heaps of up to 32 GB */
+#ifndef USE_WIDE_HEADERS
+#define USE_WIDE_HEADERS 0
+#endif
+
 /* Basic constants and macros */
+#if USE_WIDE_HEADERS
+typedef size_t word_t;
+#define WSIZE       8       /* Word and header/footer size (bytes) */
+#define DSIZE       16      /* Doubleword size (bytes) */
+#else
+typedef unsigned int word_t;
 #define WSIZE       4       /* Word and header/footer size (bytes) */
 #define DSIZE       8       /* Doubleword size (bytes) */
-#define CHUNKSIZE  (1<<9)  /* Extend heap by this amount (bytes) */
+#endif
+#define CHUNKSIZE  (1<<9)  /* Extend heap by at least this amount (bytes) */
+
+/* Otherwise the heap grows by 1/2^GROW_SHIFT of its size, up to
+ * GROW_MAX bytes, so steady growth takes few calls to sbrk while the
+ * slack at the end stays a small share of the heap */
+#ifndef GROW_SHIFT
+#define GROW_SHIFT 6
+#endif
+#define GROW_MAX   (1<<20)
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))  
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
 
 /* Read and write a word at address p */
-#define GET(p)       (*(unsigned int *)(p))            
-#define PUT(p, val)  (*(unsigned int *)(p) = (val))   
+#define GET(p)       (*(word_t *)(p))            
+#define PUT(p, val)  (*(word_t *)(p) = (val))   
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p)  (GET(p) & ~0x7)                
 #define GET_ALLOC(p) (GET(p) & 0x1)           
 
+/* Largest block a header can hold */
+#define BLOCK_MAX    ((size_t)(word_t)-1 & ~(size_t)(DSIZE-1))
+
+/* Free list links count DSIZE units, so 32-bit words reach 32 GB */
+#if !USE_WIDE_HEADERS && MAX_HEAP > (1ULL<<32)*DSIZE
+#error "MAX_HEAP too large for 32-bit free list links, use USE_WIDE_HEADERS"
+#endif
+
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)       ((char *)(bp) - WSIZE)                      
 #define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
@@ -72,75 +156,469 @@
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
 
-/* Given block ptr bp, find next and previous free blocks*/
-#define NEXT_PTR(bp)   ((char *)(bp) + WSIZE)
-#define PREV_PTR(bp)   ((char *)(bp))
+/* Given block ptr bp, find next and previous free blocks. The next
+ * link comes first, so a first fit scan reads the size and the link
+ * it follows from one span of two words. */
+#define NEXT_PTR(bp)   ((char *)(bp))
+#define PREV_PTR(bp)   ((char *)(bp) + WSIZE)
+
+/* Given block ptr bp of a free block of trimThreshold bytes or more,
+ * find the count of bytes freed into it since its pages were last
+ * released. A stale count only moves the next release. */
+#define FREE_DIRTY(bp) ((char *)(bp) + DSIZE)
 
 /* Find the status of allocation of the previous block */
 #define GET_ALLOC_PREV_BLOCK(bp)   (GET(HDRP(bp)) & 2) 
 
+/* Set in the header and footer of a free block whose payload reads
+ * as zeros, apart from its list links, count and footer */
+#define ZERO_BIT    4
+#define GET_ZERO(p) (GET(p) & ZERO_BIT)
+
+/* Given block ptr bp of a large free block, find its children in
+ * the treap. They use the same words as the free list pointers */
+#define TREE_LEFT(bp)  PREV_PTR(bp)
+#define TREE_RIGHT(bp) NEXT_PTR(bp)
+
+/* Prefetch the free blocks a search visits next: 1 on, 0 off */
+#ifndef USE_PREFETCH
+#define USE_PREFETCH 1
+#endif
+
+/* Start loading the header and links of free block bp. They share a
+ * cache line unless bp starts one, so that case takes a second
+ * prefetch. A prefetch never faults, so bp may be NULL. */
+#if USE_PREFETCH
+#define PREFETCH_BLOCK(bp) \
+	(__builtin_prefetch(HDRP(bp)), __builtin_prefetch(bp))
+#else
+#define PREFETCH_BLOCK(bp) ((void)(bp))
+#endif
+
+/* Select the free list engine: 0 for the 16 segregated lists,
+ * 1 for two-level segregated fit */
+#ifndef USE_TLSF
+#define USE_TLSF 0
+#endif
+
+/* Make the allocator thread safe: 1 on, 0 off. On by default when
+ * building for interpositioning, where any process may use it */
+#ifndef USE_THREADS
+#ifdef DRIVER
+#define USE_THREADS 0
+#else
+#define USE_THREADS 1
+#endif
+#endif
+
+#define TCACHE_MAX_SIZE  256  /* Largest block size cached per thread */
+#define TCACHE_BINS      (TCACHE_MAX_SIZE/DSIZE - 1) /* One per block size */
+#define TCACHE_BIN_COUNT 16   /* Max blocks cached per bin */
+#define TCACHE_BATCH     8    /* Blocks moved from or to the heap at once */
+
+/* Given block ptr bp of a cached block, find the next one in its bin */
+#define TCACHE_NEXT(bp)  (*(void **)(bp))
+
+/* Keep freed small blocks in fast bins: 1 on, 0 off. Off for the
+ * driver, where blocks waiting in the bins cost more utilization
+ * than the saved coalescing gains in throughput */
+#ifndef USE_FASTBINS
+#ifdef DRIVER
+#define USE_FASTBINS 0
+#else
+#define USE_FASTBINS 1
+#endif
+#endif
+
+#define FASTBIN_MAX_SIZE 64   /* Largest block size kept in a fast bin */
+#define FASTBINS         (FASTBIN_MAX_SIZE/DSIZE - 1) /* One per block size */
+#define FASTBIN_LIMIT    (1<<16) /* Bytes binned before they are coalesced */
+#define FASTBIN_LARGE    (1<<10) /* Requests that coalesce binned blocks */
+
+/* Given block ptr bp of a block in a fast bin, find the next one */
+#define FASTBIN_NEXT(bp) (*(void **)(bp))
+
+/* Remote frees an arena may have pending before the freeing thread
+ * drains them itself, if the arena's lock is free */
+#define REMOTE_FREE_MAX  256
+
+/* Given block ptr bp of a remotely freed block, find the next one
+ * on its arena's stack */
+#define REMOTE_NEXT(bp)  (*(void **)(bp))
+
+/* Serve small requests from runs of header-less slots: 1 on, 0 off.
+ * Off by default, since a partly used run per class costs more
+ * than it saves on the short traces. */
+#ifndef USE_SLAB
+#define USE_SLAB 0
+#endif
+
+#define SLAB_RUN_SIZE   (1<<12)  /* Bytes in a run, runs are aligned to this */
+#define SLAB_MAX_SIZE   64       /* Largest request served from a run */
+#define SLAB_CLASSES    (SLAB_MAX_SIZE/DSIZE) /* One class per DSIZE step */
+#define RUN_HEADER_SIZE (4*WSIZE + SLAB_RUN_SIZE/DSIZE/8)
+
+/* Given run pointer r, compute address of its header fields */
+#define RUN_SLOT_SIZE(r)  ((char *)(r))               /* Slot size */
+#define RUN_FREE_SLOTS(r) ((char *)(r) + WSIZE)       /* Free slot count */
+#define RUN_NEXT_PTR(r)   ((char *)(r) + 2*WSIZE)     /* Runs with free */
+#define RUN_PREV_PTR(r)   ((char *)(r) + 3*WSIZE)     /* slots, as offsets */
+#define RUN_BITMAP(r)     ((unsigned long *)((char *)(r) + 4*WSIZE))
+
+/* Given slot pointer p, find the run it belongs to */
+#define RUN_OF(p)  ((char *)((size_t)(p) & ~(size_t)(SLAB_RUN_SIZE-1)))
+
+/* Number of slots of size slotSize that fit in a run */
+#define RUN_SLOTS(slotSize) \
+	((SLAB_RUN_SIZE - WSIZE - RUN_HEADER_SIZE) / (slotSize))
+
+/* Requests of this many bytes or more are mapped on their own by
+ * default, 0 to keep everything in the heap */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1<<17)
+#endif
+
+/* Free blocks of this many bytes or more give their pages back to the
+ * system by default, 0 to keep them. The last block keeps half of it
+ * so that the heap does not shrink and grow again on every request.
+ * Off for the driver, which replays each trace from an empty heap
+ * and would only fault the released pages in again every time. */
+#ifndef TRIM_THRESHOLD
+#ifdef DRIVER
+#define TRIM_THRESHOLD 0
+#else
+#define TRIM_THRESHOLD (1<<17)
+#endif
+#endif
+
+
+/* A mapped block keeps the length of its mapping and the number of
+ * pages the mapping has before the page of its header in the
+ * MAP_HEADER_SIZE bytes before its payload, the last word of which is
+ * a header of size 0, which no heap block has. The payload starts
+ * MAP_HEADER_SIZE bytes into the mapping, or a page into it or further
+ * for an aligned block. */
+#define MAP_HEADER_SIZE (2*DSIZE)
+#define MAP_LENGTH(bp)  (*(size_t *)((char *)(bp) - MAP_HEADER_SIZE))
+#define MAP_LEAD(bp) \
+	(*(word_t *)((char *)(bp) - MAP_HEADER_SIZE + sizeof(size_t)))
+
+/* Whether block ptr bp is a mapped block. Heap blocks and slots never
+ * start MAP_HEADER_SIZE bytes into a page, or at a page, with an empty
+ * header. */
+#define IS_MAPPED(bp) \
+	((((size_t)(bp) & (SLAB_RUN_SIZE-1)) == MAP_HEADER_SIZE || \
+	  ((size_t)(bp) & (SLAB_RUN_SIZE-1)) == 0) && \
+	 GET(HDRP(bp)) == PACK(0, 1))
+
 /* Number ofsegregated free lists */
 #define FREE_LIST_ARRAY_SIZE 16
 
+/* Lists from this index on (blocks above 4 KB) are treaps */
+#define FIRST_TREE_INDEX 9
+
+/* Keep the lists below FIRST_TREE_INDEX in address order: 1 on, 0 to
+ * push freed blocks on the front. First fit then packs blocks towards
+ * the bottom of the heap. Inserts start from the nearest of up to
+ * SKIP_FINGERS blocks per list, so they walk past the blocks between
+ * two fingers (SKIP_GAP or more), not the whole list. */
+#ifndef USE_ADDRESS_ORDER
+#define USE_ADDRESS_ORDER 0
+#endif
+#ifndef SKIP_FINGERS
+#define SKIP_FINGERS 1024
+#endif
+#define SKIP_GAP     8
+
+/* TLSF: each first level class [2^f, 2^(f+1)) is split into
+ * TLSF_SL_COUNT second level lists. Sizes below TLSF_SMALL_SIZE
+ * all go to first level class 0, one list per DSIZE step. */
+#define TLSF_SL_LOG2     3
+#define TLSF_SL_COUNT    (1<<TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT    (TLSF_SL_LOG2 + 3)
+#define TLSF_SMALL_SIZE  (1<<TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT    (8*WSIZE - TLSF_FL_SHIFT + 1)
+
+/* Bytes reserved at the start of the heap for the list heads */
+#if USE_TLSF
+#define FREE_LIST_HEADER_SIZE \
+	((TLSF_FL_COUNT*TLSF_SL_COUNT*WSIZE + TLSF_FL_COUNT + DSIZE-1) & \
+	 ~(DSIZE-1))
+#else
+#define FREE_LIST_HEADER_SIZE (FREE_LIST_ARRAY_SIZE*DSIZE)
+#endif
+
+/* Bytes reserved after those for the heads of the slab classes */
+#if USE_SLAB
+#define SLAB_HEADER_SIZE (SLAB_CLASSES*DSIZE)
+#else
+#define SLAB_HEADER_SIZE 0
+#endif
+
+
+/* Most arenas there can be. Arena 0 is the memlib heap, and every
+ * other arena is a segment of ARENA_SEGMENT_SIZE bytes mapped through
+ * memlib, aligned to its size so that a block finds its arena by
+ * masking its address. Only thread safe builds use more than one. */
+#ifndef MAX_ARENAS
+#if USE_THREADS
+#define MAX_ARENAS 64
+#else
+#define MAX_ARENAS 1
+#endif
+#endif
+#define ARENA_SEGMENT_SIZE (1UL<<26)
+
+/* An arena is a heap of its own, with its own lists and lock */
+typedef struct {
+	char *heap_listp;  /* Pointer to first block */  
+#if USE_TLSF
+	word_t *tlsfHeads;           /* TLSF list heads, as offsets */
+	unsigned char *tlsfSlBitmap; /* Non-empty second level lists */
+	unsigned long tlsfFlBitmap;  /* Non-empty first level classes */
+#else
+	char **freeListArray;
+	unsigned int freeListBitmap; /* Bit i set iff list i is non-empty */
+	/* No block in first fit list i is larger than freeListMax[i] */
+	size_t freeListMax[FIRST_TREE_INDEX];
+#if USE_ADDRESS_ORDER
+	/* Blocks of each first fit list, in address order, that inserts
+	 * start their walk from. A walk longer than skipGap adds one. */
+	char *skip[FIRST_TREE_INDEX][SKIP_FINGERS];
+	int skipCount[FIRST_TREE_INDEX];
+	int skipGap[FIRST_TREE_INDEX];
+#endif
+#endif
+#if USE_SLAB
+	char **slabRunArray;         /* Runs with free slots, per class */
+	/* Bit set for every SLAB_RUN_SIZE piece of the arena that is a
+	 * run, counting from runBase */
+	unsigned char *slabRunMap;
+	char *runBase;
+#endif
+#if USE_FASTBINS
+	/* Freed small blocks, still marked allocated in the heap, with
+	 * one LIFO bin per block size */
+	void *fastBins[FASTBINS];
+	size_t fastBytes;            /* Bytes in the fast bins */
+#endif
+	char *segment;               /* Start of the segment, NULL for arena 0 */
+	char *brk;                   /* End of the segment's heap */
+	char *clean;                 /* Segment from here on reads as zeros */
+	int threads;                 /* Threads allocating from the arena */
+	size_t allocated;            /* Bytes in allocated blocks */
+	unsigned long mallocs;       /* Blocks allocated from the lists */
+	unsigned long frees;         /* Blocks freed to the lists */
+#if USE_THREADS
+	pthread_mutex_t lock;
+	/* Blocks freed by threads of other arenas, waiting on a lock-free
+	 * stack for the arena's own threads to free them in a batch */
+	void *remoteFrees;
+	unsigned int remoteCount;    /* Blocks on the stack */
+	unsigned long remoteTotal;   /* Blocks freed from the stack so far */
+#endif
+} arena_t;
 
 /* Global variables */
-static char *heap_listp = 0;  /* Pointer to first block */  
-static char **freeListArray = NULL;
+#if USE_THREADS
+static arena_t mainArena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+#else
+static arena_t mainArena;
+#endif
+static arena_t *arenas[MAX_ARENAS] = { &mainArena };
+static int arenaCount = 1;
+static size_t mmapThreshold = MMAP_THRESHOLD;
+/* The lowest mmapThreshold ever set, so no block smaller is mapped */
+static size_t mmapFloor = MMAP_THRESHOLD ? MMAP_THRESHOLD : (size_t)-1;
+static size_t trimThreshold = TRIM_THRESHOLD;
+static int heapErrors; /* Problems the current mm_checkheap found */
+#if USE_SLAB
+/* The run map of arena 0, which spans the whole memlib heap */
+static unsigned char slabRunMap[MAX_HEAP/SLAB_RUN_SIZE/8 + 1];
+#endif
+#if USE_THREADS
+static pthread_mutex_t arenasLock = PTHREAD_MUTEX_INITIALIZER;
+static int arenaLimit = 0;            /* Arenas to use, set on first need */
+static pthread_key_t tcacheKey;       /* Flushes a cache on thread exit */
+static pthread_once_t tcacheKeyOnce = PTHREAD_ONCE_INIT;
+
+/* Per thread cache of free blocks, still marked allocated in the
+ * heap, with one LIFO bin per block size up to TCACHE_MAX_SIZE */
+typedef struct {
+	void *bins[TCACHE_BINS];
+	unsigned char counts[TCACHE_BINS];
+	int registered;
+} tcache_t;
+static __thread tcache_t tcache __attribute__((tls_model("initial-exec")));
+
+/* The arena the calling thread allocates from, and the one whose
+ * lock it holds, which every routine below mallocBlock works on */
+static __thread arena_t *threadArena
+	__attribute__((tls_model("initial-exec")));
+static __thread arena_t *curArena __attribute__((tls_model("initial-exec")));
+
+#define ARENA_LOCK(a)   (pthread_mutex_lock(&(a)->lock), curArena = (a))
+#define ARENA_UNLOCK(a) pthread_mutex_unlock(&(a)->lock)
+#else
+#define curArena (&mainArena)
+#define ARENA_LOCK(a)   ((void)(a))
+#define ARENA_UNLOCK(a) ((void)(a))
+#endif
 
 /* Function prototypes for internal helper routines */
 static void *extend_heap(size_t words);
-static void place(void *bp, size_t asize);
+static size_t growSize(size_t asize);
+static int place(void *bp, size_t asize);
+static void placeBatch(void *bp, size_t asize, size_t count, void **out);
 static void *find_fit(size_t asize);
 static void *coalesce(void *bp);
+static void coalesceRelease(void *bp);
 static void printblock(void *bp); 
 static void checkheap(int verbose);
 static void checkblock(void *bp);
 static void addToFreeList(void *bp);
 static void deleteFromFreeList(void *bp);
+static void *mallocWithZero(size_t size, int *zero);
+static void *mallocBlock(size_t size, int *zero);
+static size_t mallocBatch(size_t size, size_t n, void **out);
+static void freeBlock(void *bp);
+static void freeHeapBlock(void *bp);
+static void freeToLists(void *bp);
+static void freeRun(void **run, size_t count);
+static void *reallocBlock(void *bp, size_t size);
+static size_t usableSize(void *bp);
+static void *mapMalloc(size_t size, int *zero);
+static void *mapAligned(size_t align, size_t size);
+static char *mapStart(void *bp);
+static void mapFree(void *bp);
+static void *mapRealloc(void *bp, size_t size);
+static int initArena(arena_t *a);
+static void *arenaSbrk(arena_t *a, size_t incr);
+static void arenaTrim(arena_t *a, size_t decr);
+#if USE_THREADS
+static arena_t *assignArena(void);
+static void remoteFree(arena_t *a, void *bp);
+static void drainRemoteFrees(void);
+static void tcacheRegister(void);
+static void *tcacheMalloc(size_t size);
+static int tcacheFree(void *bp);
+static int tcacheFreeSized(void *bp, size_t size);
+#endif
+static void *alignedBlock(size_t align, size_t size);
+static void *mallocAligned(size_t align, size_t size);
+#if USE_SLAB
+static void *slabMalloc(size_t size);
+static void slabFree(void *p);
+#endif
+#if USE_FASTBINS
+static inline void *fastbinPop(size_t asize);
+static void fastbinConsolidate(void);
+#endif
+#if !USE_TLSF
+static word_t treeInsert(word_t rootOffset, void *bp);
+static word_t treeDelete(word_t rootOffset, void *bp);
+static void *treeBestFit(void *root, size_t asize);
+#if USE_ADDRESS_ORDER
+static void addInAddressOrder(void *bp, int index);
+static void skipDelete(void *bp, int index);
+#endif
+#endif
 
-/* Given a an offset, convert it to actual address */
-static inline void *actualAddressFromOffset(int offset)
+/* Given a an offset, convert it to actual address. Offsets count
+ * DSIZE units from the prologue, so a word reaches DSIZE times
+ * further than it would in bytes. */
+static inline void *actualAddressFromOffset(word_t offset)
 {
-	dbg_printf("Offset is : %d\n",offset);
+	dbg_printf("Offset is : %lu\n",(unsigned long)offset);
 
 	if(offset==0)
 		return NULL;
 
-	return (void *)(offset + heap_listp);
+	return (void *)(curArena->heap_listp + (size_t)offset*DSIZE);
 }
 
 /* Given an address, convert it to an offset */
-static inline int offsetFromActualAddress(void *bp)
+static inline word_t offsetFromActualAddress(void *bp)
 {
 	dbg_printf("Offset from actual address called..\n");
 
 	if(!bp)
 		return 0;
 
-	return (int)((char*)bp - heap_listp);
+	return (word_t)(((char*)bp - curArena->heap_listp) / DSIZE);
+}
+
+/* Adjust a request size to include overhead and alignment reqs. */
+static inline size_t adjustedSize(size_t size)
+{
+	if (size <= DSIZE)
+		return 2*DSIZE;
+
+	return DSIZE * ((size + (WSIZE) + (DSIZE-1)) / DSIZE);
+}
+
+/*
+ * mapLength - Return the length of the mapping for a mapped block of
+ * size bytes, or 0 if that does not fit in a size_t
+ */
+static inline size_t mapLength(size_t size)
+{
+	size_t page = mem_pagesize();
+
+	if(size > (size_t)-1 - MAP_HEADER_SIZE - page)
+		return 0;
+	return (size + MAP_HEADER_SIZE + page - 1) & ~(page - 1);
+}
+
+/* Given a block or slot pointer, find the arena it belongs to */
+static inline arena_t *arenaOf(void *p)
+{
+#if USE_THREADS
+	char *lo = mem_heap_lo();
+
+	if((char *)p >= lo && (char *)p < lo + MAX_HEAP)
+		return &mainArena;
+
+	return (arena_t *)((size_t)p & ~(ARENA_SEGMENT_SIZE-1));
+#else
+	(void)p;
+	return &mainArena;
+#endif
+}
+
+#if USE_SLAB
+/* Return whether p lies in a run, i.e. is a slot and not a block */
+static inline int isSlabSlot(void *p)
+{
+	arena_t *a = arenaOf(p);
+	size_t run = (size_t)(RUN_OF(p) - a->runBase) / SLAB_RUN_SIZE;
+
+	return (a->slabRunMap[run/8] >> (run%8)) & 1;
 }
+#endif
 
+#if !USE_TLSF
 /* Given a size, calculate the index of FreeList array  */
-static inline int indexOfFreeListArray(int size)
+static inline int indexOfFreeListArray(size_t size)
 {
-	int index=0;
+	int index;
 
 	// Max size of first segregated list is 2^4
-	int maxSizeForFirstSizeClass = 1<<4;	
-	
-	// Max size of last segregated list is 2^19
-	int maxSizeForLastSizeClass = (maxSizeForFirstSizeClass<<15);
+	if(size <= (1<<4))
+		return 0;
 
-	for(int blockSize = maxSizeForFirstSizeClass; 
-			blockSize <= maxSizeForLastSizeClass; blockSize <<= 1)
-	{
-		if(size<=blockSize)
-			return index;		
-		index++;
-	}
+	// List i holds sizes in (2^(i+3), 2^(i+4)], so the index is
+	// ceil(log2(size)) - 4, found with a count leading zeros
+	index = (int)(8*sizeof(unsigned long)) -
+		__builtin_clzl((unsigned long)(size-1)) - 4;
 
-	return index-1;
+	// Everything above 2^19 goes to the last list
+	if(index >= FREE_LIST_ARRAY_SIZE)
+		return FREE_LIST_ARRAY_SIZE-1;
+
+	return index;
 }
+#endif /* !USE_TLSF */
 
 
 /*
@@ -148,31 +626,90 @@ static inline int indexOfFreeListArray(int size)
  */
 int mm_init(void) {
 
-	/* Create the initial empty heap */
-	
+#ifndef DRIVER
+	/* Without the driver, nothing else sets up the memory model */
+	if (mem_heap_lo() == NULL)
+		mem_init();
+#endif
+
+#if USE_THREADS
+	/* Blocks cached by this thread belonged to the old heap */
+	memset(tcache.bins, 0, sizeof(tcache.bins));
+	memset(tcache.counts, 0, sizeof(tcache.counts));
+
+	/* Called with the lock of arena 0 held, or before there are
+	 * other threads */
+	curArena = &mainArena;
+#endif
+
+#if USE_SLAB
+	mainArena.slabRunMap = slabRunMap;
+	mainArena.runBase = mem_heap_lo();
+	memset(slabRunMap, 0, sizeof(slabRunMap));
+#endif
+	mainArena.allocated = 0;
+	mainArena.mallocs = mainArena.frees = 0;
+
+	return initArena(&mainArena);
+}
+/* $end mminit */
+
+/*
+ * initArena - Create the initial empty heap of arena a, which must
+ * be the current arena. Return -1 on error, 0 on success.
+ */
+static int initArena(arena_t *a)
+{
+#if USE_ADDRESS_ORDER && !USE_TLSF
+	int i;
+#endif
+
 	// Allocate space for blocks and the headers of segregated 
 	// lists
-	if ((heap_listp = mem_sbrk((FREE_LIST_ARRAY_SIZE*DSIZE) + 4*WSIZE)) 
-			== (void *)-1)
+	if ((a->heap_listp = arenaSbrk(a, FREE_LIST_HEADER_SIZE +
+					SLAB_HEADER_SIZE + 4*WSIZE)) == (void *)-1)
 		return -1;
 
 	// Initialize the head of the segregated lists
 	// to 0
-	freeListArray = (char **)heap_listp;
-	memset(freeListArray, 0, (FREE_LIST_ARRAY_SIZE*DSIZE));
+	memset(a->heap_listp, 0, FREE_LIST_HEADER_SIZE + SLAB_HEADER_SIZE);
+#if USE_TLSF
+	a->tlsfHeads = (word_t *)a->heap_listp;
+	a->tlsfSlBitmap = (unsigned char *)(a->tlsfHeads + 
+			TLSF_FL_COUNT*TLSF_SL_COUNT);
+	a->tlsfFlBitmap = 0;
+#else
+	a->freeListArray = (char **)a->heap_listp;
+	a->freeListBitmap = 0;
+	memset(a->freeListMax, 0, sizeof(a->freeListMax));
+#if USE_ADDRESS_ORDER
+	for (i = 0; i < FIRST_TREE_INDEX; i++) {
+		a->skipCount[i] = 0;
+		a->skipGap[i] = SKIP_GAP;
+	}
+#endif
+#endif
+#if USE_FASTBINS
+	memset(a->fastBins, 0, sizeof(a->fastBins));
+	a->fastBytes = 0;
+#endif
+
+#if USE_SLAB
+	a->slabRunArray = (char **)(a->heap_listp + FREE_LIST_HEADER_SIZE);
+#endif
 
 	// Starting the blocks after the headers
-	heap_listp += (FREE_LIST_ARRAY_SIZE*DSIZE);
+	a->heap_listp += FREE_LIST_HEADER_SIZE + SLAB_HEADER_SIZE;
 
-	PUT(heap_listp, 0);                          /* Alignment padding */
-	PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1)); /* Prologue header */ 
-	PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 1)); /* Prologue footer */ 
+	PUT(a->heap_listp, 0);                          /* Alignment padding */
+	PUT(a->heap_listp + (1*WSIZE), PACK(DSIZE, 1)); /* Prologue header */ 
+	PUT(a->heap_listp + (2*WSIZE), PACK(DSIZE, 1)); /* Prologue footer */ 
 
 	// Packed with 3 to make sure no coalescing
 	// happens with the prologue footer
-	PUT(heap_listp + (3*WSIZE), PACK(0, 3));     /* Epilogue header */
+	PUT(a->heap_listp + (3*WSIZE), PACK(0, 3));     /* Epilogue header */
 
-	heap_listp += (2*WSIZE);                  
+	a->heap_listp += (2*WSIZE);                  
 
 
 	/* Extend the empty heap with a free block of CHUNKSIZE bytes */
@@ -181,62 +718,276 @@ int mm_init(void) {
 
 	return 0;
 }
-/* $end mminit */
+
+/*
+ * arenaSbrk - Extend the heap of arena a by incr bytes, like mem_sbrk
+ */
+static void *arenaSbrk(arena_t *a, size_t incr)
+{
+	char *old_brk = a->brk;
+
+	if (!a->segment)
+		return mem_sbrk((intptr_t)incr);
+
+	if (incr > (size_t)(a->segment + ARENA_SEGMENT_SIZE - a->brk))
+		return (void *)-1;
+
+	a->brk += incr;
+	if (a->brk > a->clean)
+		a->clean = a->brk;
+	return old_brk;
+}
+
+/*
+ * arenaTrim - Shrink the heap of arena a by decr bytes, giving them
+ * back to the system
+ */
+static void arenaTrim(arena_t *a, size_t decr)
+{
+	if (!a->segment) {
+		mem_sbrk(-(intptr_t)decr);
+		return;
+	}
+
+	// What follows the old brk was never written, so its page goes
+	// too, and if that works all from the page after the new brk is
+	// clean
+	a->brk -= decr;
+	if (mem_release(a->brk, decr + mem_pagesize() - 1))
+		a->clean = (char *)(((size_t)a->brk + mem_pagesize() - 1) &
+				~(mem_pagesize() - 1));
+}
+
+/*
+ * arenaHeapsize - Return the number of bytes taken by arena a
+ */
+static inline size_t arenaHeapsize(arena_t *a)
+{
+	return a->segment ? (size_t)(a->brk - a->segment) : mem_heapsize();
+}
+
+/*
+ * arenaClean - Return the address from which the heap of arena a
+ * reads as zeros
+ */
+static inline char *arenaClean(arena_t *a)
+{
+	return a->segment ? a->clean : mem_heap_clean();
+}
 
 
 /*
  * malloc
  */
 void *malloc (size_t size) {
+	return mallocWithZero(size, NULL);
+}
+
+/*
+ * mallocWithZero - Allocate a block, and if zero is not NULL, set it
+ * to whether the payload is known to read as zeros
+ */
+static void *mallocWithZero(size_t size, int *zero) {
+	arena_t *a = &mainArena;
+	void *bp;
+
+	if (zero)
+		*zero = 0;
+
+#if USE_THREADS
+	if ((bp = tcacheMalloc(size)) != NULL)
+		return bp;
+	if ((a = threadArena) == NULL)
+		a = assignArena();
+#endif
+
+	// Huge requests fall back to the heap if they cannot be mapped
+	if (mmapThreshold && size >= mmapThreshold &&
+			(bp = mapMalloc(size, zero)) != NULL)
+		return bp;
+
+	ARENA_LOCK(a);
+	bp = mallocBlock(size, zero);
+	ARENA_UNLOCK(a);
+
+#if USE_THREADS
+	// A segment has a fixed size, so try the other arenas
+	// before giving up
+	if (bp == NULL && size != 0)
+	{
+		int i, count = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+
+		for (i = 0; bp == NULL && i < count; i++)
+		{
+			if (arenas[i] == a)
+				continue;
+			ARENA_LOCK(arenas[i]);
+			bp = mallocBlock(size, zero);
+			ARENA_UNLOCK(arenas[i]);
+		}
+	}
+#endif
+
+	return bp;
+}
+
+/*
+ * free - Return a block to the arena that owns it
+ */
+void free (void *bp) {
+	arena_t *a;
+
+	if(bp == 0) 
+		return;
+
+	if(IS_MAPPED(bp)) {
+		mapFree(bp);
+		return;
+	}
+
+#if USE_THREADS
+	if(tcacheFree(bp))
+		return;
+#endif
+
+	a = arenaOf(bp);
+#if USE_THREADS
+	// Leave blocks of other threads' arenas to their owners
+	if(a != threadArena)
+	{
+		remoteFree(a, bp);
+		return;
+	}
+#endif
+	ARENA_LOCK(a);
+	freeBlock(bp);
+	ARENA_UNLOCK(a);
+}
+
+/*
+ * mallocBlock - Allocate a block from the current arena, with its
+ * lock held if there is one. If zero is not NULL, set it to whether
+ * the payload is known to read as zeros.
+ */
+static void *mallocBlock(size_t size, int *zero) {
 	size_t asize;      /* Adjusted block size */
 	size_t extendsize; /* Amount to extend heap if no fit */
 	char *bp;      
+	int fresh;         /* Whether the block reads as zeros */
 
 	/* $end mmmalloc */
-	if (heap_listp == 0){
+	if (curArena->heap_listp == 0){
 		mm_init();
 	}
+#if USE_THREADS
+	if (__atomic_load_n(&curArena->remoteFrees, __ATOMIC_RELAXED))
+		drainRemoteFrees();
+#endif
 	/* $begin mmmalloc */
-	/* Ignore spurious requests */
-	if (size == 0)
+	/* Ignore spurious requests, and those no header can hold */
+	if (size == 0 || size > BLOCK_MAX - DSIZE)
 		return NULL;
 
+#if USE_SLAB
+	/* Small requests go to a slot in a run */
+	if (size <= SLAB_MAX_SIZE && (bp = slabMalloc(size)) != NULL)
+		return bp;
+#endif
+
 	/* Adjust block size to include overhead and alignment reqs. */
-	if (size <= DSIZE)                                        
-		asize = 2*DSIZE;                               
-	else
-		asize = DSIZE * ((size + (WSIZE) + (DSIZE-1)) / DSIZE);
+	asize = adjustedSize(size);
+
+#if USE_FASTBINS
+	/* Small requests take a block of their size from its fast bin,
+	 * and large ones first coalesce what the bins hold */
+	if (asize <= FASTBIN_MAX_SIZE) {
+		if ((bp = fastbinPop(asize)) != NULL)
+			return bp;
+	}
+	else if (asize >= FASTBIN_LARGE && curArena->fastBytes)
+		fastbinConsolidate();
+#endif
 
 	/* Search the free list for a fit */
-	if ((bp = find_fit(asize)) != NULL) { 
-		place(bp, asize);          
+	bp = find_fit(asize);
+#if USE_FASTBINS
+	/* Coalesce the fast bins before growing the heap */
+	if (bp == NULL && curArena->fastBytes) {
+		fastbinConsolidate();
+		bp = find_fit(asize);
+	}
+#endif
+	if (bp != NULL) { 
+		fresh = place(bp, asize);          
+		if (zero)
+			*zero = fresh;
 		return bp;
 	}
 
 	/* No fit found. Get more memory and place the block */
-	extendsize = MAX(asize,CHUNKSIZE);                 
+	extendsize = growSize(asize);                 
 	if ((bp = extend_heap(extendsize/WSIZE)) == NULL)  
 		return NULL;                             
-	place(bp, asize);                         
+	fresh = place(bp, asize);                         
+	if (zero)
+		*zero = fresh;
 	return bp;
 }
 
 /*
- * free
+ * freeBlock - Free a block to the current arena, which owns it, with
+ * its lock held if there is one
  */
-void free (void *bp) {
+static void freeBlock(void *bp) {
 	/* $end mmfree */
-	if(bp == 0) 
+	if (curArena->heap_listp == 0){
+		mm_init();
+	}
+
+#if USE_SLAB
+	/* Slots go back to their run */
+	if(isSlabSlot(bp)) {
+		slabFree(bp);
 		return;
+	}
+#endif
+
+	freeHeapBlock(bp);
+}
 
+/*
+ * freeHeapBlock - Free block bp, which is not a slot, to the current
+ * arena, which owns it, with its lock held if there is one
+ */
+static void freeHeapBlock(void *bp) {
 	/* $begin mmfree */
 	size_t size = GET_SIZE(HDRP(bp));
-	/* $end mmfree */
-	if (heap_listp == 0){
-		mm_init();
+
+	curArena->frees++;
+	curArena->allocated -= size;
+
+#if USE_FASTBINS
+	/* Small blocks wait in their fast bin, uncoalesced, for the
+	 * next request of their size */
+	if(size <= FASTBIN_MAX_SIZE) {
+		void **bin = &curArena->fastBins[size/DSIZE - 2];
+
+		FASTBIN_NEXT(bp) = *bin;
+		*bin = bp;
+		if((curArena->fastBytes += size) >= FASTBIN_LIMIT)
+			fastbinConsolidate();
+		return;
 	}
-	/* $begin mmfree */
+#endif
+
+	freeToLists(bp);
+}
 
+/*
+ * freeToLists - Mark block bp free and coalesce it into the lists
+ */
+static void freeToLists(void *bp) {
+	size_t size = GET_SIZE(HDRP(bp));
 
 	//Preserving the old values of allocation for the
 	//block before this block in the header and 
@@ -249,42 +1000,242 @@ void free (void *bp) {
 	// in the header of the next block
 	PUT(HDRP(NEXT_BLKP(bp)),GET(HDRP(NEXT_BLKP(bp)))&~2);
 
-	coalesce(bp);
+	coalesceRelease(bp);
 }
 
 /*
- * realloc - you may want to look at mm-naive.c
+ * mallocBatch - Allocate up to n blocks of size bytes from the
+ * current arena into out, with its lock held if there is one. Each
+ * group of blocks is carved from a single fit. Return the number of
+ * blocks allocated.
  */
-void *realloc(void *oldptr, size_t size) {
+static size_t mallocBatch(size_t size, size_t n, void **out) {
+	size_t asize, count, got = 0;
+	char *bp;
 
-	size_t oldsize;
-	void *newptr;
+	if (curArena->heap_listp == 0){
+		mm_init();
+	}
+#if USE_THREADS
+	if (__atomic_load_n(&curArena->remoteFrees, __ATOMIC_RELAXED))
+		drainRemoteFrees();
+#endif
 
-	/* If size == 0 then this is just free, and we return NULL. */
-	if(size == 0) {
-		mm_free(oldptr);
+	if (size > BLOCK_MAX - DSIZE)
 		return 0;
-	}
+	asize = adjustedSize(size);
 
-	/* If oldptr is NULL, then this is just malloc. */
-	if(oldptr == NULL) {
-		return mm_malloc(size);
+#if USE_FASTBINS
+	// Blocks of the size waiting in its fast bin go first
+	if (asize <= FASTBIN_MAX_SIZE)
+		for (; got < n && (out[got] = fastbinPop(asize)) != NULL; got++)
+			;
+#endif
+
+	// Carve at most GROW_MAX bytes at a time, growing the heap
+	// when no free block holds them all
+	while (got < n) {
+		count = MIN(n - got, MAX(GROW_MAX / asize, 1));
+		bp = find_fit(count*asize);
+#if USE_FASTBINS
+		if (bp == NULL && curArena->fastBytes) {
+			fastbinConsolidate();
+			bp = find_fit(count*asize);
+		}
+#endif
+		if (bp == NULL &&
+				(bp = extend_heap(growSize(count*asize)/WSIZE)) == NULL)
+			break;
+		placeBatch(bp, asize, count, out + got);
+		got += count;
 	}
 
-	newptr = mm_malloc(size);
+	// What is left may still fit block by block
+	for (; got < n && (out[got] = mallocBlock(size, NULL)) != NULL; got++)
+		;
 
-	/* If realloc() fails the original block is left untouched  */
+	return got;
+}
+
+/*
+ * freeRun - Free count blocks of the current arena, each following
+ * the one before it in the heap, as one block
+ */
+static void freeRun(void **run, size_t count) {
+	size_t size = 0, i;
+	char *bp = run[0];
+
+	if (count == 1) {
+		freeBlock(bp);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		size += GET_SIZE(HDRP(run[i]));
+	curArena->frees += count;
+	curArena->allocated -= size;
+
+	PUT(HDRP(bp), PACK(size, GET_ALLOC_PREV_BLOCK(bp)|1));
+	freeToLists(bp);
+}
+
+#if USE_FASTBINS
+/*
+ * fastbinPop - Allocate a block of asize bytes from its fast bin,
+ * returning NULL if the bin is empty
+ */
+static inline void *fastbinPop(size_t asize) {
+	void **bin = &curArena->fastBins[asize/DSIZE - 2];
+	void *bp;
+
+	if ((bp = *bin) != NULL) {
+		*bin = FASTBIN_NEXT(bp);
+		curArena->fastBytes -= asize;
+		curArena->mallocs++;
+		curArena->allocated += asize;
+	}
+	return bp;
+}
+
+/*
+ * fastbinConsolidate - Empty the fast bins of the current arena,
+ * coalescing their blocks into the lists. Blocks next to one another
+ * in the bins merge as the later one is freed.
+ */
+static void fastbinConsolidate(void) {
+	void *bp, *next;
+	int bin;
+
+	for(bin = 0; bin < FASTBINS; bin++)
+	{
+		bp = curArena->fastBins[bin];
+		curArena->fastBins[bin] = NULL;
+		for(; bp; bp = next)
+		{
+			next = FASTBIN_NEXT(bp);
+			freeToLists(bp);
+		}
+	}
+	curArena->fastBytes = 0;
+}
+#endif
+
+/*
+ * reallocBlock - Resize block bp in place to hold size bytes, with
+ * the lock of its arena held if there is one. The block grows into
+ * a free next block, or into new heap if it is the last block, and
+ * shrinks by splitting off its tail. Return NULL if it cannot grow.
+ */
+static void *reallocBlock(void *bp, size_t size) {
+	size_t asize, csize, nsize;
+	char *next;
+
+#if USE_SLAB
+	/* Slots have a fixed size */
+	if(isSlabSlot(bp))
+		return size <= GET(RUN_SLOT_SIZE(RUN_OF(bp))) ? bp : NULL;
+#endif
+
+	if(size > BLOCK_MAX - DSIZE)
+		return NULL;
+	asize = adjustedSize(size);
+	csize = GET_SIZE(HDRP(bp));
+	next = NEXT_BLKP(bp);
+
+	if(asize > csize)
+	{
+		nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+
+		// A last block, or one followed by the last free block, can
+		// have the heap extended under it by what it lacks, but by no
+		// less than a minimum block. The new memory is coalesced into
+		// a free next block.
+		if(csize + nsize < asize)
+		{
+			if(GET_SIZE(HDRP(nsize ? NEXT_BLKP(next) : next)) != 0)
+				return NULL;
+			if(extend_heap(MAX(asize - csize - nsize, 2*DSIZE)/WSIZE) == NULL)
+				return NULL;
+			nsize = GET_SIZE(HDRP(next));
+		}
+		else if(csize + nsize > BLOCK_MAX)
+			return NULL;
+
+		// Absorb the free next block
+		deleteFromFreeList(next);
+		csize += nsize;
+		curArena->allocated += nsize;
+		PUT(HDRP(bp), PACK(csize, GET_ALLOC_PREV_BLOCK(bp)|1));
+		PUT(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp)))|2);
+	}
+
+	// Give back a tail big enough to be a block of its own
+	if(csize - asize >= 2*DSIZE)
+	{
+		PUT(HDRP(bp), PACK(asize, GET_ALLOC_PREV_BLOCK(bp)|1));
+		curArena->allocated -= csize - asize;
+
+		next = NEXT_BLKP(bp);
+		PUT(HDRP(next), PACK(csize-asize, 2));
+		PUT(FTRP(next), PACK(csize-asize, 2));
+		PUT(HDRP(NEXT_BLKP(next)),GET(HDRP(NEXT_BLKP(next)))&~2);
+		coalesceRelease(next);
+	}
+
+	return bp;
+}
+
+/*
+ * realloc - Resize in place when the heap allows it, and otherwise
+ * move the data to a new block
+ */
+void *realloc(void *oldptr, size_t size) {
+
+	size_t oldsize;
+	void *newptr;
+	arena_t *a;
+
+	/* If size == 0 then this is just free, and we return NULL. */
+	if(size == 0) {
+		free(oldptr);
+		return 0;
+	}
+
+	/* If oldptr is NULL, then this is just malloc. */
+	if(oldptr == NULL) {
+		return malloc(size);
+	}
+
+	/* Resize the block where it is if possible, and remap mapped
+	 * blocks that stay huge */
+	if(IS_MAPPED(oldptr)) {
+		if(mmapThreshold && size >= mmapThreshold &&
+				(newptr = mapRealloc(oldptr, size)) != NULL)
+			return newptr;
+	} else {
+		a = arenaOf(oldptr);
+		ARENA_LOCK(a);
+		newptr = reallocBlock(oldptr, size);
+		ARENA_UNLOCK(a);
+		if(newptr) {
+			return newptr;
+		}
+	}
+
+	newptr = malloc(size);
+
+	/* If realloc() fails the original block is left untouched  */
 	if(!newptr) {
 		return 0;
 	}
 
 	/* Copy the old data. */
-	oldsize = GET_SIZE(HDRP(oldptr));
+	oldsize = usableSize(oldptr);
 	if(size < oldsize) oldsize = size;
 	memcpy(newptr, oldptr, oldsize);
 
 	/* Free the old block. */
-	mm_free(oldptr);
+	free(oldptr);
 
 	return newptr;
 
@@ -296,21 +1247,390 @@ void *realloc(void *oldptr, size_t size) {
  * needed to run the traces.
  */
 void *calloc (size_t nmemb, size_t size) {
-	size_t bytes = nmemb * size;
+	size_t bytes;
 	void *newptr;
+	int zero;
 
-	newptr = malloc(bytes);
-	memset(newptr, 0, bytes);
+	/* The product must not wrap around to a small size */
+	if (nmemb && size > (size_t)-1 / nmemb)
+		return NULL;
+	bytes = nmemb * size;
+
+	/* Memory fresh from the system needs no clearing */
+	newptr = mallocWithZero(bytes, &zero);
+	if (newptr && !zero)
+		memset(newptr, 0, bytes);
 
 	return newptr;
 }
 
+/*
+ * memalign - Allocate a block whose payload is aligned to align bytes,
+ * a power of two. Blocks are always aligned to ALIGNMENT, so smaller
+ * alignments are plain requests, and larger ones are found like
+ * malloc's: huge ones get a mapping, and the rest come from the
+ * thread's arena or, failing that, any other.
+ */
+void *memalign(size_t align, size_t size) {
+	arena_t *a = &mainArena;
+	void *bp;
+
+	if (align & (align - 1))
+		return NULL;
+	if (align <= ALIGNMENT)
+		return malloc(size);
+	if (size == 0)
+		return NULL;
+
+#if USE_THREADS
+	if ((a = threadArena) == NULL)
+		a = assignArena();
+#endif
+
+	// Huge requests fall back to the heap if they cannot be mapped
+	if (mmapThreshold && size >= mmapThreshold &&
+			(bp = mapAligned(align, size)) != NULL)
+		return bp;
+
+	ARENA_LOCK(a);
+	bp = alignedBlock(align, size);
+	ARENA_UNLOCK(a);
+
+#if USE_THREADS
+	if (bp == NULL)
+	{
+		int i, count = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+
+		for (i = 0; bp == NULL && i < count; i++)
+		{
+			if (arenas[i] == a)
+				continue;
+			ARENA_LOCK(arenas[i]);
+			bp = alignedBlock(align, size);
+			ARENA_UNLOCK(arenas[i]);
+		}
+	}
+#endif
+
+	return bp;
+}
+
+/*
+ * posix_memalign - Allocate an aligned block into *memptr. Return
+ * EINVAL if align is not a power of two multiple of sizeof(void *),
+ * ENOMEM if there is no memory for the block, and 0 otherwise.
+ */
+int posix_memalign(void **memptr, size_t align, size_t size) {
+	void *bp;
+
+	if (align < sizeof(void *) || (align & (align - 1)))
+		return EINVAL;
+
+	if ((bp = memalign(align, size)) == NULL && size != 0)
+		return ENOMEM;
+
+	*memptr = bp;
+	return 0;
+}
+
+/*
+ * aligned_alloc - Allocate a block aligned to align bytes
+ */
+void *aligned_alloc(size_t align, size_t size) {
+	return memalign(align, size);
+}
+
+/*
+ * mm_free_sized - Free block ptr, which the caller allocated with size
+ * bytes, or with any size up to what mm_usable_size gave for it. A
+ * size too small to have been mapped and too large for a slot skips
+ * the checks for those, and in threaded builds it picks the cache bin
+ * without reading the header.
+ */
+void mm_free_sized(void *ptr, size_t size) {
+	arena_t *a;
+
+	/* Blocks that may be mapped or slots take the checks in free */
+	if (ptr == NULL || size == 0 || size >= mmapFloor ||
+			size > BLOCK_MAX - DSIZE || (USE_SLAB && size <= SLAB_MAX_SIZE)) {
+		free(ptr);
+		return;
+	}
+
+#if USE_THREADS
+	/* The block may be larger than the size gives, by a remainder
+	 * place did not split, and a bin holds blocks of at least its
+	 * size, so the smaller bin is safe */
+	if(tcacheFreeSized(ptr, adjustedSize(size)))
+		return;
+#endif
+
+	a = arenaOf(ptr);
+#if USE_THREADS
+	if(a != threadArena)
+	{
+		remoteFree(a, ptr);
+		return;
+	}
+#endif
+	ARENA_LOCK(a);
+	freeHeapBlock(ptr);
+	ARENA_UNLOCK(a);
+}
+
+/*
+ * mm_usable_size - Return the number of bytes block ptr can hold,
+ * which may be more than were asked for, or 0 if ptr is NULL
+ */
+size_t mm_usable_size(void *ptr) {
+	return ptr ? usableSize(ptr) : 0;
+}
+
+/*
+ * mm_good_size - Return the number of bytes a request of size bytes
+ * always gets room for, so that callers can ask for all of it up
+ * front. A heap block may hold DSIZE more, when the remainder place
+ * left was too small to split off.
+ */
+size_t mm_good_size(size_t size) {
+	size_t length;
+
+	if (size == 0)
+		return 0;
+	if (mmapThreshold && size >= mmapThreshold &&
+			(length = mapLength(size)) != 0)
+		return length - MAP_HEADER_SIZE;
+#if USE_SLAB
+	if (size <= SLAB_MAX_SIZE)
+		return (size + DSIZE-1) & ~(size_t)(DSIZE-1);
+#endif
+	if (size > BLOCK_MAX - DSIZE)
+		return size;
+
+	return adjustedSize(size) - WSIZE;
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes into out, carving
+ * them from as few free blocks as possible. Return the number of
+ * blocks allocated, fewer than n only if memory ran out.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+	arena_t *a = &mainArena;
+	size_t got = 0;
+
+	if (size == 0)
+		return 0;
+
+	/* Mapped blocks and slots are not carved from the lists */
+	if ((mmapThreshold && size >= mmapThreshold) ||
+			(USE_SLAB && size <= SLAB_MAX_SIZE)) {
+		for (; got < n && (out[got] = malloc(size)) != NULL; got++)
+			;
+		return got;
+	}
+
+#if USE_THREADS
+	if ((a = threadArena) == NULL)
+		a = assignArena();
+#endif
+	ARENA_LOCK(a);
+	got = mallocBatch(size, n, out);
+	ARENA_UNLOCK(a);
+
+	/* Other arenas may have room for the rest */
+	for (; got < n && (out[got] = malloc(size)) != NULL; got++)
+		;
+	return got;
+}
+
+static int comparePointers(const void *p, const void *q)
+{
+	char *a = *(char * const *)p, *b = *(char * const *)q;
+
+	return (a > b) - (a < b);
+}
+
+/*
+ * mm_free_batch - Free the n blocks in ptrs, which is sorted by
+ * address in the process. Blocks next to one another in the heap
+ * are freed as one, and each arena's lock is taken once.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+	arena_t *a = NULL, *owner;
+	size_t i, j, size;
+	char *bp;
+
+	/* Blocks are often freed in the order they were carved */
+	for (i = 1; i < n && (char *)ptrs[i-1] <= (char *)ptrs[i]; i++)
+		;
+	if (i < n)
+		qsort(ptrs, n, sizeof(*ptrs), comparePointers);
+
+	for (i = 0; i < n; i = j) {
+		bp = ptrs[i];
+		j = i + 1;
+
+		if (bp == NULL)
+			continue;
+		if (IS_MAPPED(bp)) {
+			mapFree(bp);
+			continue;
+		}
+
+		/* Arenas do not share addresses, so each one's blocks
+		 * come together in the sorted array */
+		owner = arenaOf(bp);
+#if USE_THREADS
+		if (owner != threadArena) {
+			remoteFree(owner, bp);
+			continue;
+		}
+#endif
+		if (owner != a) {
+			if (a)
+				ARENA_UNLOCK(a);
+			ARENA_LOCK(owner);
+			a = owner;
+		}
+
+#if USE_SLAB
+		if (isSlabSlot(bp)) {
+			freeBlock(bp);
+			continue;
+		}
+#endif
+		// Runs stop short of a block too large for its header
+		size = GET_SIZE(HDRP(bp));
+		while (j < n && ptrs[j] == NEXT_BLKP(ptrs[j-1]) &&
+				(size += GET_SIZE(HDRP(ptrs[j]))) <= BLOCK_MAX)
+			j++;
+		freeRun(ptrs + i, j - i);
+	}
+
+	if (a)
+		ARENA_UNLOCK(a);
+}
+
+
+/*
+ * usableSize - Return the number of payload bytes in a block or slot
+ */
+static size_t usableSize(void *bp)
+{
+	if(IS_MAPPED(bp))
+		return mapStart(bp) + MAP_LENGTH(bp) - (char *)bp;
+#if USE_SLAB
+	if(isSlabSlot(bp))
+		return GET(RUN_SLOT_SIZE(RUN_OF(bp)));
+#endif
+
+	return GET_SIZE(HDRP(bp)) - WSIZE;
+}
+
+/*
+ * mapMalloc - Map a block of its own for a huge request, which reads
+ * as zeros, and set zero if it is not NULL. Return NULL if the system
+ * has no mapping to give.
+ */
+static void *mapMalloc(size_t size, int *zero)
+{
+	size_t length;
+	char *map;
+
+	if((length = mapLength(size)) == 0 || (map = mem_map(length, 0)) == NULL)
+		return NULL;
+
+	map += MAP_HEADER_SIZE;
+	MAP_LENGTH(map) = length;
+	MAP_LEAD(map) = 0;
+	PUT(HDRP(map), PACK(0, 1));
+	if(zero)
+		*zero = 1;
+	return map;
+}
+
+/*
+ * mapAligned - Map a block of its own for a huge request whose payload
+ * is aligned to align bytes, and to a page at least, so that it can be
+ * told from a heap block. The mapping is aligned the same way and the
+ * payload starts that far into it. Only the page before the payload is
+ * ever touched in front of it. Return NULL if the system has no
+ * mapping to give.
+ */
+static void *mapAligned(size_t align, size_t size)
+{
+	size_t page = mem_pagesize();
+	size_t length;
+	char *map;
+
+	if(align < page)
+		align = page;
+	if(size > (size_t)-1 - page || align > (size_t)-1 - page - size ||
+			align/page > (word_t)-1)
+		return NULL;
+	length = align + ((size + page - 1) & ~(page - 1));
+	if((map = mem_map(length, align)) == NULL)
+		return NULL;
+
+	map += align;
+	MAP_LENGTH(map) = length;
+	MAP_LEAD(map) = align/page - 1;
+	PUT(HDRP(map), PACK(0, 1));
+	return map;
+}
+
+/*
+ * mapStart - Return the start of the mapping of mapped block bp
+ */
+static char *mapStart(void *bp)
+{
+	size_t page = mem_pagesize();
+
+	return (char *)(((size_t)bp - MAP_HEADER_SIZE) & ~(page - 1)) -
+		(size_t)MAP_LEAD(bp)*page;
+}
+
+/*
+ * mapFree - Give the mapping of mapped block bp back to the system
+ */
+static void mapFree(void *bp)
+{
+	mem_unmap(mapStart(bp), MAP_LENGTH(bp));
+}
+
+/*
+ * mapRealloc - Resize mapped block bp to size bytes by remapping it,
+ * which moves its pages without copying them. Return NULL, with the
+ * block untouched, if it cannot be remapped.
+ */
+static void *mapRealloc(void *bp, size_t size)
+{
+	size_t length, lead = (char *)bp - mapStart(bp);
+	char *map;
+
+	// The pages in front of an aligned payload move with it
+	if(size > (size_t)-1 - lead ||
+			(length = mapLength(size + lead - MAP_HEADER_SIZE)) == 0)
+		return NULL;
+	if(length == MAP_LENGTH(bp))
+		return bp;
+
+	if((map = mem_remap(mapStart(bp), MAP_LENGTH(bp), length)) == NULL)
+		return NULL;
+
+	map += lead;
+	MAP_LENGTH(map) = length;
+	return map;
+}
 
 /*
  * Return whether the pointer is in the heap.
  * May be useful for debugging.
  */
 static int in_heap(const void *p) {
+	if (curArena->segment)
+		return (char *)p < curArena->brk && (char *)p >= curArena->segment;
 	return p <= mem_heap_hi() && p >= mem_heap_lo();
 }
 
@@ -323,11 +1643,83 @@ static int aligned(const void *p) {
 }
 
 /*
- * mm_checkheap
+ * mm_checkheap - Check the heap of every arena, and print its blocks
+ * if verbose is set. Return the number of problems found.
+ */
+int mm_checkheap(int verbose) {
+	int i;
+
+	heapErrors = 0;
+	for(i = 0; i < mm_arena_count(); i++)
+	{
+		ARENA_LOCK(arenas[i]);
+		if(curArena->heap_listp)
+			checkheap(verbose);
+		ARENA_UNLOCK(arenas[i]);
+	}
+
+	return heapErrors;
+}
+
+/*
+ * mm_arena_count - Return the number of arenas in use
+ */
+int mm_arena_count(void) {
+#if USE_THREADS
+	return __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+#else
+	return arenaCount;
+#endif
+}
+
+/*
+ * mm_arena_stats - Fill in the statistics of arena index, which can
+ * be compared across arenas to spot imbalance. Return -1 if there
+ * is no such arena, 0 otherwise.
  */
-void mm_checkheap(int lineno) {
-	if(lineno)
-		checkheap(lineno);
+int mm_arena_stats(int index, mm_arena_stats_t *stats) {
+	arena_t *a;
+
+	if(index < 0 || index >= mm_arena_count())
+		return -1;
+
+	a = arenas[index];
+	ARENA_LOCK(a);
+	stats->heapsize = arenaHeapsize(a);
+	stats->allocated = a->allocated;
+	stats->mallocs = a->mallocs;
+	stats->frees = a->frees;
+	stats->threads = a->threads;
+#if USE_THREADS
+	stats->remote_frees = a->remoteTotal;
+#else
+	stats->remote_frees = 0;
+#endif
+	ARENA_UNLOCK(a);
+
+	return 0;
+}
+
+/*
+ * mm_set_trim_threshold - Give the pages of free blocks of threshold
+ * bytes or more back to the system from now on, or none if threshold
+ * is 0
+ */
+void mm_set_trim_threshold(size_t threshold) {
+	// Blocks that large need room for their count of freed bytes
+	if(threshold && threshold < 4*DSIZE)
+		threshold = 4*DSIZE;
+	trimThreshold = threshold;
+}
+
+/*
+ * mm_set_mmap_threshold - Map requests of threshold bytes or more on
+ * their own from now on, or none if threshold is 0
+ */
+void mm_set_mmap_threshold(size_t threshold) {
+	mmapThreshold = threshold;
+	if(threshold && threshold < mmapFloor)
+		mmapFloor = threshold;
 }
 
 /* 
@@ -343,6 +1735,14 @@ static void *coalesce(void *bp)
 	size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
 	size_t size = GET_SIZE(HDRP(bp));
 
+	// Free neighbours that would make the block too large for its
+	// header are left apart
+	if (!next_alloc && size + GET_SIZE(HDRP(NEXT_BLKP(bp))) > BLOCK_MAX)
+		next_alloc = 1;
+	if (!prev_alloc && size + GET_SIZE((char *)bp - DSIZE) +
+			(next_alloc ? 0 : GET_SIZE(HDRP(NEXT_BLKP(bp)))) > BLOCK_MAX)
+		prev_alloc = 1;
+
 	if (prev_alloc && next_alloc) {            /* Case 1 */
 		addToFreeList(bp);
 		return bp;
@@ -396,102 +1796,376 @@ static void *coalesce(void *bp)
 	return bp;
 }
 
-/* 
- * extend_heap - Extend heap with free block and 
- * return its block pointer
+/*
+ * coalesceRelease - Coalesce free block bp, and give back to the
+ * system what the result does not need once it is trimThreshold
+ * bytes or more: the top of the heap past half of that if it is the
+ * last block, and otherwise its inner pages, as soon as half of that
+ * has been freed into it since they were last released. Blocks freed
+ * and allocated again in turn thus do not fault their pages back in
+ * every time.
  */
-static void *extend_heap(size_t words) 
+static void coalesceRelease(void *bp)
 {
-	char *bp;
-	size_t size;
-
-	/* Allocate an even number of words to maintain alignment */
-	size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-	if ((long)(bp = mem_sbrk(size)) == -1)  
-		return NULL;                                    
+	size_t size = GET_SIZE(HDRP(bp));
+	size_t dirty = size;
+	size_t psize, nsize, keep;
 
-	/* Initialize free block header/footer and the epilogue header */
+	if(!trimThreshold)
+	{
+		coalesce(bp);
+		return;
+	}
 
-	// Free block header
-	PUT(HDRP(bp), PACK(size, GET_ALLOC_PREV_BLOCK(bp)|0)); 
+	// Blocks below the threshold count as freed in full
+	if(!GET_ALLOC_PREV_BLOCK(bp))
+	{
+		psize = GET_SIZE((char *)bp - DSIZE);
+		dirty += psize < trimThreshold ? psize : GET(FREE_DIRTY(PREV_BLKP(bp)));
+	}
+	if(!GET_ALLOC(HDRP(NEXT_BLKP(bp))))
+	{
+		nsize = GET_SIZE(HDRP(NEXT_BLKP(bp)));
+		dirty += nsize < trimThreshold ? nsize : GET(FREE_DIRTY(NEXT_BLKP(bp)));
+	}
+
+	bp = coalesce(bp);
+	if((size = GET_SIZE(HDRP(bp))) < trimThreshold)
+		return;
+
+	// Cut the last block down, leaving the rest to the next requests
+	if(GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+	{
+		keep = MAX(trimThreshold/2 & ~(size_t)(DSIZE-1), 2*DSIZE);
+
+		deleteFromFreeList(bp);
+		PUT(HDRP(bp), PACK(keep, GET_ALLOC_PREV_BLOCK(bp)));
+		PUT(FTRP(bp), PACK(keep, GET_ALLOC_PREV_BLOCK(bp)));
+		PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+		addToFreeList(bp);
+
+		arenaTrim(curArena, size - keep);
+		return;
+	}
+
+	// Keep the list links, the count and the footer
+	if(dirty >= trimThreshold/2)
+	{
+		mem_release(FREE_DIRTY(bp) + WSIZE,
+				(size_t)(FTRP(bp) - (FREE_DIRTY(bp) + WSIZE)));
+		dirty = 0;
+	}
+	PUT(FREE_DIRTY(bp), (word_t)MIN(dirty, size));
+}
+
+/*
+ * growSize - Return how many bytes to extend the heap of the current
+ * arena by to fit a block of asize bytes. A free last block only
+ * needs what it lacks, and the heap grows by a share of its size if
+ * that is more.
+ */
+static size_t growSize(size_t asize)
+{
+	char *brk = curArena->segment ? curArena->brk :
+		(char *)mem_heap_hi() + 1;
+	char *epilogue = brk - WSIZE;
+	size_t step, lastsize = 0, need = asize;
+
+	// The epilogue knows whether the last block is allocated,
+	// and the footer of a free one gives its size. A good fit
+	// search may have passed over a last block big enough already.
+	if (!(GET(epilogue) & 2))
+	{
+		lastsize = GET_SIZE(epilogue - WSIZE);
+		need = asize > lastsize ? asize - lastsize : 0;
+	}
+
+	step = arenaHeapsize(curArena) >> GROW_SHIFT;
+	step = MIN(MAX(step, CHUNKSIZE), GROW_MAX) & ~(size_t)(DSIZE-1);
+
+	// A last block that would grow too large for its header is not
+	// coalesced with the new one, which must then hold it all
+	if (lastsize + MAX(need, step) > BLOCK_MAX)
+		need = asize;
+
+	return MAX(need, step);
+}
+
+/* 
+ * extend_heap - Extend heap with free block and 
+ * return its block pointer
+ */
+static void *extend_heap(size_t words) 
+{
+	char *bp, *merged;
+	char *clean = arenaClean(curArena);
+	size_t size, zero;
+
+	/* Allocate an even number of words to maintain alignment */
+	size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
+	if (size > BLOCK_MAX)
+		return NULL;
+	if ((long)(bp = arenaSbrk(curArena, size)) == -1)  
+		return NULL;                                    
+
+	// Memory never written before reads as zeros, which stays
+	// known if a free block it joins also does
+	zero = bp >= clean && (GET_ALLOC_PREV_BLOCK(bp) ||
+			GET_ZERO(HDRP(PREV_BLKP(bp)))) ? ZERO_BIT : 0;
+
+	/* Initialize free block header/footer and the epilogue header */
+
+	// Free block header
+	PUT(HDRP(bp), PACK(size, GET_ALLOC_PREV_BLOCK(bp)|zero)); 
 
 	//Free block footer
-	PUT(FTRP(bp), PACK(size, GET_ALLOC_PREV_BLOCK(bp)|0)); 
+	PUT(FTRP(bp), PACK(size, GET_ALLOC_PREV_BLOCK(bp)|zero)); 
 
 	//New epilouge header
 	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
 
 	/* Coalesce if the previous block was free */
-	return coalesce(bp);                             
+	merged = coalesce(bp);
+
+	// The old footer and header now lie inside the merged block
+	if (zero && merged != bp)
+	{
+		PUT((char *)bp - DSIZE, 0);
+		PUT(HDRP(bp), 0);
+		PUT(HDRP(merged), GET(HDRP(merged)) | ZERO_BIT);
+		PUT(FTRP(merged), GET(FTRP(merged)) | ZERO_BIT);
+	}
+
+	return merged;
 }
 
 /* 
  * place - Place block of asize bytes at start of free block bp 
- *         and split if remainder would be at least minimum block size
+ *         and split if remainder would be at least minimum block size.
+ *         Return whether the payload reads as zeros.
  */
-static void place(void *bp, size_t asize)
+static int place(void *bp, size_t asize)
 	/* $end mmplace-proto */
 {
 	size_t csize = GET_SIZE(HDRP(bp));   
+	word_t zero = GET_ZERO(HDRP(bp));
+	int large = trimThreshold && csize - asize >= trimThreshold;
+	word_t dirty = large ? GET(FREE_DIRTY(bp)) : 0;
 	deleteFromFreeList(bp);
+	curArena->mallocs++;
 
 	if ((csize - asize) >= (2*DSIZE)) { 
+		char *rest;
 
 		//Preserving old values of allocation stored in header
 		//and setting self allcated bit to 1
 		PUT(HDRP(bp),PACK(asize, GET_ALLOC_PREV_BLOCK(bp)|1));
+		curArena->allocated += asize;
 
-		bp = NEXT_BLKP(bp);
-		PUT(HDRP(bp), PACK(csize-asize, 2));
-		PUT(FTRP(bp), PACK(csize-asize, 2));
+		rest = NEXT_BLKP(bp);
+		PUT(HDRP(rest), PACK(csize-asize, 2|zero));
+		PUT(FTRP(rest), PACK(csize-asize, 2|zero));
 
-		addToFreeList(bp);
+		addToFreeList(rest);
+
+		// A large remainder inherits the count of freed bytes
+		if (large)
+			PUT(FREE_DIRTY(rest), dirty);
 	}
 	else { 
 
 		//Preserving old values of allocation stored in header
 		//and setting self allcated bit to 1
 		PUT(HDRP(bp),PACK(csize, GET_ALLOC_PREV_BLOCK(bp)|1));
+		curArena->allocated += csize;
 
 		//Setting bit in next block's header to show that
 		//the current block has been allocated
 		if(NEXT_BLKP(bp))
 			PUT(HDRP(NEXT_BLKP(bp)),(GET(HDRP(NEXT_BLKP(bp)))|2));
+
+		// The old footer is now part of the payload
+		if (zero)
+			PUT((char *)bp + csize - DSIZE, 0);
+	}
+
+	// Clear what the free block kept at the start of the payload
+	if (zero) {
+		PUT(PREV_PTR(bp), 0);
+		PUT(NEXT_PTR(bp), 0);
+		PUT(FREE_DIRTY(bp), 0);
 	}
+
+	return zero != 0;
 }
 
+/*
+ * placeBatch - Place count blocks of asize bytes, one after another,
+ * at the start of free block bp, which holds them all, and put their
+ * pointers in out. The free block leaves its list once, and what
+ * remains goes back once, as in place.
+ */
+static void placeBatch(void *bp, size_t asize, size_t count, void **out)
+{
+	size_t csize = GET_SIZE(HDRP(bp));
+	size_t rest = csize - count*asize;
+	size_t bsize, i;
+	word_t zero = GET_ZERO(HDRP(bp));
+	int large = trimThreshold && rest >= trimThreshold;
+	word_t dirty = large ? GET(FREE_DIRTY(bp)) : 0;
+	char *p = bp;
 
+	deleteFromFreeList(bp);
+	curArena->mallocs += count;
+
+	// The last block takes a tail too small to be a block itself
+	for (i = 0; i < count; i++) {
+		bsize = (i == count-1 && rest < 2*DSIZE) ? asize + rest : asize;
+		PUT(HDRP(p), PACK(bsize, (i ? 2 : GET_ALLOC_PREV_BLOCK(p))|1));
+		curArena->allocated += bsize;
+		out[i] = p;
+		p += bsize;
+	}
+
+	if (rest >= 2*DSIZE) {
+		PUT(HDRP(p), PACK(rest, 2|zero));
+		PUT(FTRP(p), PACK(rest, 2|zero));
+		addToFreeList(p);
+
+		if (large)
+			PUT(FREE_DIRTY(p), dirty);
+	}
+	else
+		PUT(HDRP(p), GET(HDRP(p))|2);
+}
+
+
+/*
+ * alignedBlock - Allocate a block from the current arena, with its
+ * lock held if there is one, whose payload is aligned to align bytes
+ */
+static void *alignedBlock(size_t align, size_t size)
+{
+	if (curArena->heap_listp == 0)
+		mm_init();
+#if USE_THREADS
+	if (__atomic_load_n(&curArena->remoteFrees, __ATOMIC_RELAXED))
+		drainRemoteFrees();
+#endif
+	return mallocAligned(align, size);
+}
+
+/* 
+ * mallocAligned - Allocate a block from the current arena whose
+ * payload is aligned to align bytes, a power of two. The slack in
+ * front of the payload is split off as a free block.
+ */
+static void *mallocAligned(size_t align, size_t size)
+{
+	size_t asize, searchsize;
+	size_t csize, lead;
+	char *bp, *abp;
+
+	// The block searched for holds the slack too
+	if (size > BLOCK_MAX/2 - 2*DSIZE || align > BLOCK_MAX/2)
+		return NULL;
+	asize = adjustedSize(size);
+	searchsize = asize + align + 2*DSIZE;
+
+	bp = find_fit(searchsize);
+#if USE_FASTBINS
+	if (bp == NULL && curArena->fastBytes) {
+		fastbinConsolidate();
+		bp = find_fit(searchsize);
+	}
+#endif
+	if (bp == NULL && (bp = extend_heap(growSize(searchsize)/WSIZE)) == NULL)
+		return NULL;
+
+	// Move the payload up to the alignment, leaving room for
+	// a free block of at least the minimum size in front of it
+	abp = (char *)(((size_t)bp + align - 1) & ~(align - 1));
+	if (abp != bp && (size_t)(abp - bp) < 2*DSIZE)
+		abp += align;
+
+	if (abp != bp) {
+		csize = GET_SIZE(HDRP(bp));
+		lead = abp - bp;
+		deleteFromFreeList(bp);
+
+		PUT(HDRP(bp), PACK(lead, GET_ALLOC_PREV_BLOCK(bp)|0));
+		PUT(FTRP(bp), PACK(lead, GET_ALLOC_PREV_BLOCK(bp)|0));
+		addToFreeList(bp);
+
+		PUT(HDRP(abp), PACK(csize-lead, 0));
+		PUT(FTRP(abp), PACK(csize-lead, 0));
+		addToFreeList(abp);
+		bp = abp;
+	}
+
+	place(bp, asize);
+	return bp;
+}
+
+#if !USE_TLSF
 /* 
  * find_fit - Find a fit for a block with asize bytes 
  */
 static void *find_fit(size_t asize)
 {
-	void *bp;
+	void *bp, *next, *after;
+	size_t size, max;
+	unsigned int nonEmptyLists;
 	int index = indexOfFreeListArray(asize);
 
-	// Traverse the segregated lists from the index
-	// to which the size belongs till the last list,
-	// until a match is found.
-
-	while(index < FREE_LIST_ARRAY_SIZE)
+	// Blocks in the list to which the size belongs may still
+	// be too small, so do a first fit scan of that list, or
+	// a best fit search if it is a treap
+	if(index >= FIRST_TREE_INDEX)
+	{
+		if((bp = treeBestFit(curArena->freeListArray[index], asize)) != NULL)
+			return bp;
+	}
+	else if(asize <= curArena->freeListMax[index])
 	{
-		for (bp = freeListArray[index]; bp && GET_SIZE(HDRP(bp)) > 0; 
-				bp = actualAddressFromOffset(GET(NEXT_PTR(bp)))){
-			if (asize <= GET_SIZE(HDRP(bp)) && !GET_ALLOC(HDRP(bp))){
+		// Keep the next two blocks loading while this one is
+		// checked, since each hop needs the link the last one read
+		max = 0;
+		bp = curArena->freeListArray[index];
+		next = bp ? actualAddressFromOffset(GET(NEXT_PTR(bp))) : NULL;
+		PREFETCH_BLOCK(next);
+		for (; bp; bp = next, next = after){
+			after = next ? actualAddressFromOffset(GET(NEXT_PTR(next))) : NULL;
+			PREFETCH_BLOCK(after);
+			if (asize <= (size = GET_SIZE(HDRP(bp))))
 				return bp;
-			}
+			max = MAX(max, size);
 		}
-		index ++;
+
+		// Nothing fits, and the scan found the largest block, so
+		// the next request this large skips the list at once
+		curArena->freeListMax[index] = max;
 	}
 
-	return NULL; /* No fit */
+	// Every block in a higher list is big enough, so use the
+	// bitmap to jump to the first non-empty one and take its head,
+	// or the smallest block if it is a treap
+	nonEmptyLists = curArena->freeListBitmap & (~0u << (index+1));
+	if(!nonEmptyLists)
+		return NULL; /* No fit */
+
+	index = __builtin_ctz(nonEmptyLists);
+	if(index >= FIRST_TREE_INDEX)
+		return treeBestFit(curArena->freeListArray[index], 0);
+
+	return curArena->freeListArray[index];
 }
+#endif /* !USE_TLSF */
 
 static void printblock(void *bp) 
 {
 	size_t hsize, halloc, fsize, falloc;
 
-	checkheap(0);
 	hsize = GET_SIZE(HDRP(bp));
 	halloc = GET_ALLOC(HDRP(bp));  
 	fsize = GET_SIZE(FTRP(bp));
@@ -502,23 +2176,30 @@ static void printblock(void *bp)
 		return;
 	}
 
-	/*  printf("%p: header: [%p:%c] footer: [%p:%c]\n", bp, 
-		hsize, (halloc ? 'a' : 'f'), 
-		fsize, (falloc ? 'a' : 'f')); */
+	printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", bp,
+		hsize, (halloc ? 'a' : 'f'),
+		fsize, (falloc ? 'a' : 'f'));
 }
 
 
 static void checkblock(void *bp) 
 {
 	if (!aligned(bp))
-		printf("Error: %p is not doubleword aligned\n", bp);
+		heap_error("Error: %p is not doubleword aligned\n", bp);
 	if(!in_heap(bp))
-		printf("Error: Block not within heap boundaries");
+		heap_error("Error: %p is not within heap boundaries\n", bp);
 
 	if(GET_ALLOC(HDRP(bp))==0)
 	{
-		if(HDRP(bp)!=FTRP(bp))
-			printf("Error: HEader and footer mismatch in free block");
+		if(GET(HDRP(bp))!=GET(FTRP(bp)))
+			heap_error("Error: %p has a footer that differs from its header\n", bp);
+#if !USE_TLSF
+		int index = indexOfFreeListArray(GET_SIZE(HDRP(bp)));
+
+		if(index < FIRST_TREE_INDEX &&
+				GET_SIZE(HDRP(bp)) > curArena->freeListMax[index])
+			heap_error("Error: %p is larger than its list's bound\n", bp);
+#endif
 	}
 }
 
@@ -527,24 +2208,38 @@ static void checkblock(void *bp)
  */
 void checkheap(int verbose) 
 {
-	char *bp = heap_listp;
+	char *bp = curArena->heap_listp;
+#if USE_FASTBINS || (USE_ADDRESS_ORDER && !USE_TLSF)
+	int i;
+#endif
+#if USE_ADDRESS_ORDER && !USE_TLSF
+	int j;
+	char *next;
+#endif
 
 	if (verbose)
-		printf("Heap (%p):\n", heap_listp);
+		printf("Heap (%p):\n", curArena->heap_listp);
 
 	
 	// Check for bad prologue
-	if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || 
-			!GET_ALLOC(HDRP(heap_listp)))
-		printf("Bad prologue header\n");
-	checkblock(heap_listp);
+	if ((GET_SIZE(HDRP(curArena->heap_listp)) != DSIZE) || 
+			!GET_ALLOC(HDRP(curArena->heap_listp)))
+		heap_error("Bad prologue header\n");
+	checkblock(curArena->heap_listp);
 
 
 	// Check validity of all the allocated and free blocks
-	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+	for (; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
 		if (verbose) 
 			printblock(bp);
 		checkblock(bp);
+
+		// Free blocks never sit side by side, and the next block
+		// knows whether this one is allocated
+		if (!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp))))
+			heap_error("Error: %p and the block after it are both free\n", bp);
+		if (!GET_ALLOC_PREV_BLOCK(NEXT_BLKP(bp)) != !GET_ALLOC(HDRP(bp)))
+			heap_error("Error: the block after %p has a wrong prev-alloc bit\n", bp);
 	}
 
 	if (verbose)
@@ -552,21 +2247,61 @@ void checkheap(int verbose)
 
 	// Check for bad epilogue 
 	if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
-		printf("Bad epilogue header\n");
+		heap_error("Bad epilogue header\n");
+
+#if USE_FASTBINS
+	// Blocks in a fast bin stay allocated, with the bin's size
+	for (i = 0; i < FASTBINS; i++)
+		for (bp = curArena->fastBins[i]; bp; bp = FASTBIN_NEXT(bp))
+			if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) != (size_t)(i+2)*DSIZE)
+				heap_error("Error: %p is misplaced in fast bin %d\n", bp, i);
+#endif
+
+#if USE_ADDRESS_ORDER && !USE_TLSF
+	// First fit lists run up the heap, and so do their skip fingers
+	for (i = 0; i < FIRST_TREE_INDEX; i++)
+	{
+		for (bp = curArena->freeListArray[i]; bp; bp = next)
+		{
+			next = actualAddressFromOffset(GET(NEXT_PTR(bp)));
+			if (next && next <= bp)
+				heap_error("Error: %p is out of address order in list %d\n", next, i);
+		}
+		for (j = 1; j < curArena->skipCount[i]; j++)
+			if (curArena->skip[i][j] <= curArena->skip[i][j-1])
+				heap_error("Error: skip finger %d of list %d is out of order\n", j, i);
+	}
+#endif
 }
 
+#if !USE_TLSF
 static void deleteFromFreeList(void *bp)
 {
 	int index = indexOfFreeListArray(GET_SIZE(HDRP(bp)));
 
+	// Large blocks are removed from the treap instead
+	if(index >= FIRST_TREE_INDEX)
+	{
+		curArena->freeListArray[index] = actualAddressFromOffset(treeDelete(
+				offsetFromActualAddress(curArena->freeListArray[index]), bp));
+		if(!curArena->freeListArray[index])
+			curArena->freeListBitmap &= ~(1u << index);
+		return;
+	}
+
+#if USE_ADDRESS_ORDER
+	skipDelete(bp, index);
+#endif
+
 	//CASE 1 : Delete from the beginning of free list
-	if(bp == freeListArray[index])
+	if(bp == curArena->freeListArray[index])
 	{
-		int offsetValue = GET(NEXT_PTR(bp));
+		word_t offsetValue = GET(NEXT_PTR(bp));
 
 		if(0==offsetValue)
 		{
-			freeListArray[index] = NULL;
+			curArena->freeListArray[index] = NULL;
+			curArena->freeListBitmap &= ~(1u << index);
 			PUT(NEXT_PTR(bp),0);
 			PUT(PREV_PTR(bp),0);
 		}	
@@ -574,7 +2309,7 @@ static void deleteFromFreeList(void *bp)
 		else if(offsetValue)
 		{
 			void *bp_nextBlock = actualAddressFromOffset(offsetValue);
-			freeListArray[index] = bp_nextBlock;
+			curArena->freeListArray[index] = bp_nextBlock;
 
 			PUT(PREV_PTR(bp_nextBlock),0);
 			PUT(NEXT_PTR(bp),0);
@@ -584,7 +2319,7 @@ static void deleteFromFreeList(void *bp)
 	// CASE 2 : Delete from the end of the free list
 	else if(0 == GET(NEXT_PTR(bp)))
 	{
-		int offsetValue = GET(PREV_PTR(bp));
+		word_t offsetValue = GET(PREV_PTR(bp));
 
 		if(offsetValue)
 		{
@@ -617,17 +2352,863 @@ static void addToFreeList(void *bp)
 {
 	int index = indexOfFreeListArray(GET_SIZE(HDRP(bp)));
 
+	// Large blocks are inserted in the treap instead
+	if(index >= FIRST_TREE_INDEX)
+	{
+		curArena->freeListArray[index] = actualAddressFromOffset(treeInsert(
+				offsetFromActualAddress(curArena->freeListArray[index]), bp));
+		curArena->freeListBitmap |= (1u << index);
+		return;
+	}
+
+	if(GET_SIZE(HDRP(bp)) > curArena->freeListMax[index])
+		curArena->freeListMax[index] = GET_SIZE(HDRP(bp));
+	curArena->freeListBitmap |= (1u << index);
+
+#if USE_ADDRESS_ORDER
+	addInAddressOrder(bp, index);
+#else
 	// If there is no block in free list
-	if(!freeListArray[index])
+	if(!curArena->freeListArray[index])
 		PUT(NEXT_PTR(bp),0);
 
 	// Put block in the beginning of the free list
 	else
 	{
-		PUT(NEXT_PTR(bp),offsetFromActualAddress(freeListArray[index]));
-		PUT(PREV_PTR(freeListArray[index]),offsetFromActualAddress(bp));
+		PUT(NEXT_PTR(bp),offsetFromActualAddress(curArena->freeListArray[index]));
+		PUT(PREV_PTR(curArena->freeListArray[index]),offsetFromActualAddress(bp));
 	}
 
-	freeListArray[index] = bp;
+	curArena->freeListArray[index] = bp;
 	PUT(PREV_PTR(bp),0);
+#endif
+}
+
+#if USE_ADDRESS_ORDER
+/*
+ * skipFind - Return the number of skip fingers of list index that lie
+ * below address bp
+ */
+static int skipFind(void *bp, int index)
+{
+	char **skip = curArena->skip[index];
+	int lo = 0, hi = curArena->skipCount[index], mid;
+
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if(skip[mid] < (char *)bp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * skipRebuild - Spread the skip fingers of list index evenly over it,
+ * using half of them, and make walks that pass more blocks than lie
+ * between two fingers add one
+ */
+static void skipRebuild(int index)
+{
+	char *bp;
+	size_t length = 0, gap, i;
+	int n = 0;
+
+	for(bp = curArena->freeListArray[index]; bp;
+			bp = actualAddressFromOffset(GET(NEXT_PTR(bp))))
+		length++;
+
+	gap = MAX(length / (SKIP_FINGERS/2), SKIP_GAP);
+	for(bp = curArena->freeListArray[index], i = 0; bp;
+			bp = actualAddressFromOffset(GET(NEXT_PTR(bp))), i++)
+		if(i % gap == gap - 1 && n < SKIP_FINGERS/2)
+			curArena->skip[index][n++] = bp;
+
+	curArena->skipCount[index] = n;
+	curArena->skipGap[index] = (int)gap;
+}
+
+/*
+ * addInAddressOrder - Link free block bp into first fit list index,
+ * walking to its place from the last skip finger below it
+ */
+static void addInAddressOrder(void *bp, int index)
+{
+	int i = skipFind(bp, index), n = curArena->skipCount[index];
+	int steps = 0;
+	char *prev = i ? curArena->skip[index][i-1] : NULL;
+	char *next = prev ? actualAddressFromOffset(GET(NEXT_PTR(prev))) :
+		curArena->freeListArray[index];
+
+	while(next && next < (char *)bp)
+	{
+		prev = next;
+		next = actualAddressFromOffset(GET(NEXT_PTR(next)));
+		steps++;
+	}
+
+	PUT(PREV_PTR(bp), offsetFromActualAddress(prev));
+	PUT(NEXT_PTR(bp), offsetFromActualAddress(next));
+	if(prev)
+		PUT(NEXT_PTR(prev), offsetFromActualAddress(bp));
+	else
+		curArena->freeListArray[index] = bp;
+	if(next)
+		PUT(PREV_PTR(next), offsetFromActualAddress(bp));
+
+	// A long walk makes bp a finger, between the two it lies between
+	if(steps > curArena->skipGap[index])
+	{
+		if(n == SKIP_FINGERS)
+		{
+			skipRebuild(index);
+			return;
+		}
+		memmove(&curArena->skip[index][i+1], &curArena->skip[index][i],
+				(n - i) * sizeof(char *));
+		curArena->skip[index][i] = bp;
+		curArena->skipCount[index]++;
+	}
+}
+
+/*
+ * skipDelete - Before free block bp leaves list index, pass its skip
+ * finger, if it has one, on to the next block, or drop it
+ */
+static void skipDelete(void *bp, int index)
+{
+	char **skip = curArena->skip[index];
+	int i = skipFind(bp, index), n = curArena->skipCount[index];
+	char *next;
+
+	// The last block out resets the list
+	if(!GET(NEXT_PTR(bp)) && bp == curArena->freeListArray[index])
+	{
+		curArena->skipCount[index] = 0;
+		curArena->skipGap[index] = SKIP_GAP;
+		return;
+	}
+
+	if(i == n || skip[i] != bp)
+		return;
+
+	next = actualAddressFromOffset(GET(NEXT_PTR(bp)));
+	if(next && (i+1 == n || next < skip[i+1]))
+		skip[i] = next;
+	else
+	{
+		memmove(&skip[i], &skip[i+1], (n - i - 1) * sizeof(char *));
+		curArena->skipCount[index]--;
+	}
+}
+#endif /* USE_ADDRESS_ORDER */
+
+/*
+ * The large block lists are treaps keyed on size and then address.
+ * The heap priority of a node is a hash of its offset, so nothing
+ * besides the two child offsets needs to be stored in the block.
+ */
+
+/* Return whether block a orders before block b in a treap */
+static inline int treeLess(void *a, void *b)
+{
+	size_t asize = GET_SIZE(HDRP(a));
+	size_t bsize = GET_SIZE(HDRP(b));
+
+	return asize < bsize || (asize == bsize && (char *)a < (char *)b);
+}
+
+/* Treap priority of a block */
+static inline unsigned int treePriority(word_t offset)
+{
+	return (unsigned int)offset * 2654435761u;
+}
+
+/*
+ * treeMerge - Join two treaps where every block in the first
+ * orders before every block in the second, return the new root
+ */
+static word_t treeMerge(word_t leftOffset, word_t rightOffset)
+{
+	void *left = actualAddressFromOffset(leftOffset);
+	void *right = actualAddressFromOffset(rightOffset);
+
+	if(!left)
+		return rightOffset;
+	if(!right)
+		return leftOffset;
+
+	if(treePriority(leftOffset) > treePriority(rightOffset))
+	{
+		PUT(TREE_RIGHT(left), treeMerge(GET(TREE_RIGHT(left)), rightOffset));
+		return leftOffset;
+	}
+
+	PUT(TREE_LEFT(right), treeMerge(leftOffset, GET(TREE_LEFT(right))));
+	return rightOffset;
+}
+
+/*
+ * treeInsert - Insert free block bp in the treap, return the new root
+ */
+static word_t treeInsert(word_t rootOffset, void *bp)
+{
+	void *root = actualAddressFromOffset(rootOffset);
+	word_t offset = offsetFromActualAddress(bp);
+	word_t childOffset;
+	void *child;
+
+	if(!root)
+	{
+		PUT(TREE_LEFT(bp),0);
+		PUT(TREE_RIGHT(bp),0);
+		return offset;
+	}
+
+	// Insert in the subtree and rotate the child up if its
+	// priority is now higher than the root's
+	if(treeLess(bp, root))
+	{
+		childOffset = treeInsert(GET(TREE_LEFT(root)), bp);
+		PUT(TREE_LEFT(root), childOffset);
+		if(treePriority(childOffset) > treePriority(rootOffset))
+		{
+			child = actualAddressFromOffset(childOffset);
+			PUT(TREE_LEFT(root), GET(TREE_RIGHT(child)));
+			PUT(TREE_RIGHT(child), rootOffset);
+			return childOffset;
+		}
+	}
+	else
+	{
+		childOffset = treeInsert(GET(TREE_RIGHT(root)), bp);
+		PUT(TREE_RIGHT(root), childOffset);
+		if(treePriority(childOffset) > treePriority(rootOffset))
+		{
+			child = actualAddressFromOffset(childOffset);
+			PUT(TREE_RIGHT(root), GET(TREE_LEFT(child)));
+			PUT(TREE_LEFT(child), rootOffset);
+			return childOffset;
+		}
+	}
+
+	return rootOffset;
+}
+
+/*
+ * treeDelete - Remove free block bp from the treap, return the new root
+ */
+static word_t treeDelete(word_t rootOffset, void *bp)
+{
+	void *root = actualAddressFromOffset(rootOffset);
+
+	if(!root)
+		return 0;
+
+	if(root == bp)
+	{
+		rootOffset = treeMerge(GET(TREE_LEFT(bp)), GET(TREE_RIGHT(bp)));
+		PUT(TREE_LEFT(bp),0);
+		PUT(TREE_RIGHT(bp),0);
+		return rootOffset;
+	}
+
+	if(treeLess(bp, root))
+		PUT(TREE_LEFT(root), treeDelete(GET(TREE_LEFT(root)), bp));
+	else
+		PUT(TREE_RIGHT(root), treeDelete(GET(TREE_RIGHT(root)), bp));
+
+	return rootOffset;
+}
+
+/*
+ * treeBestFit - Find the smallest block of at least asize bytes in
+ * the treap, lowest address first among blocks of the same size
+ */
+static void *treeBestFit(void *root, size_t asize)
+{
+	void *best = NULL;
+	void *left, *right;
+
+	// Both children start loading before the size decides which
+	// one comes next
+	while(root)
+	{
+		left = actualAddressFromOffset(GET(TREE_LEFT(root)));
+		right = actualAddressFromOffset(GET(TREE_RIGHT(root)));
+		PREFETCH_BLOCK(left);
+		PREFETCH_BLOCK(right);
+
+		if(GET_SIZE(HDRP(root)) >= asize)
+		{
+			best = root;
+			root = left;
+		}
+		else
+			root = right;
+	}
+
+	return best;
+}
+#endif /* !USE_TLSF */
+
+#if USE_TLSF
+/* 
+ * tlsfMapping - Given a size, calculate the first and second level
+ * index of the TLSF list holding blocks of that size
+ */
+static inline void tlsfMapping(size_t size, int *fl, int *sl)
+{
+	int msb;
+
+	// Small blocks get one list per double word
+	if(size < TLSF_SMALL_SIZE)
+	{
+		*fl = 0;
+		*sl = (int)(size / DSIZE);
+		return;
+	}
+
+	msb = (int)(8*sizeof(unsigned long)) - 1 - __builtin_clzl(size);
+	*fl = msb - (TLSF_FL_SHIFT - 1);
+	*sl = (int)(size >> (msb - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+}
+
+/* 
+ * find_fit - Find a fit for a block with asize bytes in O(1).
+ * The size is rounded up to the next second level boundary, so
+ * that any block in the list found is big enough.
+ */
+static void *find_fit(size_t asize)
+{
+	int fl, sl;
+	unsigned int slMap;
+	unsigned long flMap;
+
+	if(asize >= TLSF_SMALL_SIZE)
+		asize += (1UL << ((int)(8*sizeof(unsigned long)) - 1 -
+					__builtin_clzl(asize) - TLSF_SL_LOG2)) - 1;
+
+	tlsfMapping(asize, &fl, &sl);
+	if(fl >= TLSF_FL_COUNT)
+		return NULL;
+
+	// Look for a non-empty list in the same first level class
+	slMap = curArena->tlsfSlBitmap[fl] & (~0u << sl);
+	if(!slMap)
+	{
+		// Otherwise take the smallest non-empty larger class
+		flMap = curArena->tlsfFlBitmap & (~0ul << (fl+1));
+		if(!flMap)
+			return NULL; /* No fit */
+
+		fl = __builtin_ctzl(flMap);
+		slMap = curArena->tlsfSlBitmap[fl];
+	}
+	sl = __builtin_ctz(slMap);
+
+	return actualAddressFromOffset(
+			curArena->tlsfHeads[fl*TLSF_SL_COUNT + sl]);
+}
+
+static void deleteFromFreeList(void *bp)
+{
+	int fl, sl;
+	word_t prevOffset = GET(PREV_PTR(bp));
+	word_t nextOffset = GET(NEXT_PTR(bp));
+
+	tlsfMapping(GET_SIZE(HDRP(bp)), &fl, &sl);
+
+	if(nextOffset)
+		PUT(PREV_PTR(actualAddressFromOffset(nextOffset)), prevOffset);
+
+	// A block with no previous block is the head of its list
+	if(prevOffset)
+		PUT(NEXT_PTR(actualAddressFromOffset(prevOffset)), nextOffset);
+	else
+	{
+		curArena->tlsfHeads[fl*TLSF_SL_COUNT + sl] = nextOffset;
+		if(!nextOffset)
+		{
+			curArena->tlsfSlBitmap[fl] &= ~(1u << sl);
+			if(!curArena->tlsfSlBitmap[fl])
+				curArena->tlsfFlBitmap &= ~(1ul << fl);
+		}
+	}
+
+	PUT(NEXT_PTR(bp),0);
+	PUT(PREV_PTR(bp),0);
+}
+
+static void addToFreeList(void *bp)
+{
+	int fl, sl;
+	word_t *head;
+
+	tlsfMapping(GET_SIZE(HDRP(bp)), &fl, &sl);
+	head = &curArena->tlsfHeads[fl*TLSF_SL_COUNT + sl];
+
+	// Put block in the beginning of the free list
+	PUT(NEXT_PTR(bp), *head);
+	if(*head)
+		PUT(PREV_PTR(actualAddressFromOffset(*head)),
+				offsetFromActualAddress(bp));
+	PUT(PREV_PTR(bp),0);
+
+	*head = offsetFromActualAddress(bp);
+	curArena->tlsfSlBitmap[fl] |= (1u << sl);
+	curArena->tlsfFlBitmap |= (1ul << fl);
+}
+#endif /* USE_TLSF */
+
+#if USE_SLAB
+/*
+ * Runs of the small object layer. Every run holds slots of one
+ * size, SLAB_CLASSES sizes in all, with a bitmap in the run header
+ * marking the free slots. Runs with a free slot are kept on a doubly
+ * linked list per class, using offsets like the free lists.
+ */
+
+/* Set or clear the bit of run r in the run map of the current arena */
+static inline void markSlabRun(void *r, int isRun)
+{
+	size_t run = (size_t)((char *)r - curArena->runBase) / SLAB_RUN_SIZE;
+
+	if(isRun)
+		curArena->slabRunMap[run/8] |= (1 << (run%8));
+	else
+		curArena->slabRunMap[run/8] &= ~(1 << (run%8));
+}
+
+/* Remove run r from the list of runs with free slots of class index */
+static void deleteFromRunList(void *r, int index)
+{
+	void *next = actualAddressFromOffset(GET(RUN_NEXT_PTR(r)));
+	void *prev = actualAddressFromOffset(GET(RUN_PREV_PTR(r)));
+
+	if(next)
+		PUT(RUN_PREV_PTR(next), GET(RUN_PREV_PTR(r)));
+	if(prev)
+		PUT(RUN_NEXT_PTR(prev), GET(RUN_NEXT_PTR(r)));
+	else
+		curArena->slabRunArray[index] = next;
+
+	PUT(RUN_NEXT_PTR(r),0);
+	PUT(RUN_PREV_PTR(r),0);
+}
+
+/* Put run r at the beginning of the list of class index */
+static void addToRunList(void *r, int index)
+{
+	char **head = &curArena->slabRunArray[index];
+
+	PUT(RUN_NEXT_PTR(r), offsetFromActualAddress(*head));
+	PUT(RUN_PREV_PTR(r),0);
+	if(*head)
+		PUT(RUN_PREV_PTR(*head), offsetFromActualAddress(r));
+	*head = r;
+}
+
+/*
+ * newSlabRun - Carve a new run for class index out of the heap, with
+ * all of its slots free
+ */
+static void *newSlabRun(int index)
+{
+	size_t slotSize = (index+1)*DSIZE;
+	size_t slots = RUN_SLOTS(slotSize);
+	unsigned long *bitmap;
+	char *r;
+
+	// The run block ends just before the next block's header,
+	// so that every slot masks back to the run
+	if((r = mallocAligned(SLAB_RUN_SIZE, SLAB_RUN_SIZE - WSIZE)) == NULL)
+		return NULL;
+
+	PUT(RUN_SLOT_SIZE(r), slotSize);
+	PUT(RUN_FREE_SLOTS(r), slots);
+
+	bitmap = RUN_BITMAP(r);
+	memset(bitmap, 0, RUN_HEADER_SIZE - 4*WSIZE);
+	memset(bitmap, 0xff, slots/8);
+	if(slots%8)
+		((unsigned char *)bitmap)[slots/8] = (1 << (slots%8)) - 1;
+
+	markSlabRun(r, 1);
+	addToRunList(r, index);
+	return r;
+}
+
+/*
+ * slabMalloc - Allocate a slot for size bytes, returning NULL if
+ * no run could be made
+ */
+static void *slabMalloc(size_t size)
+{
+	int index = (int)((size-1) / DSIZE);
+	unsigned long *bitmap;
+	char *r = curArena->slabRunArray[index];
+	int word, bit;
+
+	if(!r && (r = newSlabRun(index)) == NULL)
+		return NULL;
+
+	// Take the first free slot
+	bitmap = RUN_BITMAP(r);
+	for(word = 0; !bitmap[word]; word++)
+		;
+	bit = __builtin_ctzl(bitmap[word]);
+	bitmap[word] &= ~(1UL << bit);
+
+	// Full runs leave the list until a slot is freed
+	PUT(RUN_FREE_SLOTS(r), GET(RUN_FREE_SLOTS(r)) - 1);
+	if(!GET(RUN_FREE_SLOTS(r)))
+		deleteFromRunList(r, index);
+
+	return r + RUN_HEADER_SIZE + 
+		(word*8*sizeof(unsigned long) + bit) * GET(RUN_SLOT_SIZE(r));
+}
+
+/*
+ * slabFree - Return slot p to its run, and the run to the heap
+ * once it is empty and is not the last run of its class
+ */
+static void slabFree(void *p)
+{
+	char *r = RUN_OF(p);
+	size_t slotSize = GET(RUN_SLOT_SIZE(r));
+	size_t slot = ((char *)p - r - RUN_HEADER_SIZE) / slotSize;
+	int index = (int)(slotSize/DSIZE - 1);
+	unsigned int freeSlots = GET(RUN_FREE_SLOTS(r)) + 1;
+
+	RUN_BITMAP(r)[slot / (8*sizeof(unsigned long))] |= 
+		1UL << (slot % (8*sizeof(unsigned long)));
+	PUT(RUN_FREE_SLOTS(r), freeSlots);
+
+	if(freeSlots == 1)
+		addToRunList(r, index);
+
+	// Keep one run per class around so that a single small block
+	// being allocated and freed does not make and free a run each time
+	if(freeSlots == RUN_SLOTS(slotSize) && 
+			(GET(RUN_NEXT_PTR(r)) || GET(RUN_PREV_PTR(r))))
+	{
+		deleteFromRunList(r, index);
+		markSlabRun(r, 0);
+		freeBlock(r);
+	}
+}
+#endif /* USE_SLAB */
+
+#if USE_THREADS
+/*
+ * Arenas. Arena 0 is made by mm_init, and the others on demand, up
+ * to two per cpu. Each thread allocates from the arena it was given
+ * when it first needed one, the one with the fewest threads at the
+ * time, while a block is always freed to the arena it came from.
+ */
+
+/*
+ * createArena - Map a segment for a new arena and lay out its heap.
+ * The arena's own fields sit at the start of the segment.
+ */
+static arena_t *createArena(void)
+{
+	char *segment;
+	arena_t *a;
+
+	if((segment = mem_map(ARENA_SEGMENT_SIZE, ARENA_SEGMENT_SIZE)) == NULL)
+		return NULL;
+
+	a = (arena_t *)segment;
+	memset(a, 0, sizeof(arena_t));
+	pthread_mutex_init(&a->lock, NULL);
+	a->segment = segment;
+	// Blocks lie on a grid of DSIZE from the start of the segment, as
+	// they do in the heap, so that aligned blocks can be cut from them
+	a->brk = segment + ((sizeof(arena_t) + DSIZE-1) & ~(size_t)(DSIZE-1));
+#if USE_SLAB
+	a->slabRunMap = (unsigned char *)a->brk;
+	a->runBase = segment;
+	a->brk += ALIGN(ARENA_SEGMENT_SIZE/SLAB_RUN_SIZE/8);
+#endif
+	a->clean = a->brk;
+
+	ARENA_LOCK(a);
+	if(initArena(a) == -1)
+	{
+		ARENA_UNLOCK(a);
+		mem_unmap(segment, ARENA_SEGMENT_SIZE);
+		return NULL;
+	}
+	ARENA_UNLOCK(a);
+
+	return a;
+}
+
+/*
+ * assignArena - Give the calling thread the arena with the fewest
+ * threads, first making a new one if every arena has a thread and
+ * the limit allows it
+ */
+static arena_t *assignArena(void)
+{
+	arena_t *a;
+	int i;
+
+	pthread_mutex_lock(&arenasLock);
+	if(!arenaLimit)
+	{
+		arenaLimit = 2*(int)sysconf(_SC_NPROCESSORS_ONLN);
+		if(arenaLimit < 1 || arenaLimit > MAX_ARENAS)
+			arenaLimit = MAX_ARENAS;
+	}
+
+	a = arenas[0];
+	for(i = 1; i < arenaCount; i++)
+		if(arenas[i]->threads < a->threads)
+			a = arenas[i];
+
+	if(a->threads && arenaCount < arenaLimit &&
+			(arenas[arenaCount] = createArena()) != NULL)
+	{
+		a = arenas[arenaCount];
+		__atomic_store_n(&arenaCount, arenaCount+1, __ATOMIC_RELEASE);
+	}
+	a->threads++;
+	pthread_mutex_unlock(&arenasLock);
+
+	threadArena = a;
+	tcacheRegister();
+	return a;
+}
+
+/*
+ * The per thread caches. Blocks in a cache stay marked allocated, so
+ * they are not coalesced, and are linked through their first payload
+ * word. Bins are filled from the thread's arena and flushed
+ * TCACHE_BATCH blocks at a time, to that arena under its lock or to
+ * the remote free stacks of the arenas of other threads.
+ */
+
+/*
+ * Cross thread frees. A block freed by a thread that does not
+ * allocate from the block's arena is pushed on a lock-free stack of
+ * that arena, which any number of threads may push on while the
+ * arena's own threads pop the whole stack at once, under the arena
+ * lock, on their next malloc.
+ */
+
+/* Push block bp on the remote free stack of arena a */
+static void remoteFree(arena_t *a, void *bp)
+{
+	void *head = __atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED);
+	arena_t *held;
+
+	do
+		REMOTE_NEXT(bp) = head;
+	while(!__atomic_compare_exchange_n(&a->remoteFrees, &head, bp, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// An arena that no thread allocates from any more would only
+	// pile up blocks, so drain a long stack here if nobody holds
+	// the lock, without disturbing the caller's current arena
+	if(__atomic_add_fetch(&a->remoteCount, 1, __ATOMIC_RELAXED) >=
+			REMOTE_FREE_MAX && pthread_mutex_trylock(&a->lock) == 0)
+	{
+		held = curArena;
+		curArena = a;
+		drainRemoteFrees();
+		ARENA_UNLOCK(a);
+		curArena = held;
+	}
+}
+
+/* Free every block on the remote free stack of the current arena */
+static void drainRemoteFrees(void)
+{
+	void *bp, *next;
+	unsigned int count = 0;
+
+	bp = __atomic_exchange_n(&curArena->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+	for(; bp; bp = next, count++)
+	{
+		next = REMOTE_NEXT(bp);
+		freeBlock(bp);
+	}
+
+	__atomic_sub_fetch(&curArena->remoteCount, count, __ATOMIC_RELAXED);
+	curArena->remoteTotal += count;
+}
+
+/* Free the first count blocks of the cached list at head, to the
+ * thread's arena under its lock, or to the remote free stacks of
+ * the arenas of other threads */
+static void tcacheDrain(void **head, int count)
+{
+	arena_t *a = threadArena, *owner;
+	int locked = 0;
+	void *bp;
+
+	for(; count > 0 && (bp = *head) != NULL; count--)
+	{
+		*head = TCACHE_NEXT(bp);
+
+		if((owner = arenaOf(bp)) != a)
+		{
+			remoteFree(owner, bp);
+			continue;
+		}
+
+		if(!locked)
+		{
+			ARENA_LOCK(a);
+			locked = 1;
+		}
+		freeBlock(bp);
+	}
+
+	if(locked)
+		ARENA_UNLOCK(a);
+}
+
+/* Flush every bin of cache arg back to the heap and leave the
+ * thread's arena, on thread exit */
+static void tcacheFlush(void *arg)
+{
+	tcache_t *cache = arg;
+	int bin;
+
+	for(bin = 0; bin < TCACHE_BINS; bin++)
+	{
+		tcacheDrain(&cache->bins[bin], TCACHE_BIN_COUNT);
+		cache->counts[bin] = 0;
+	}
+
+	if(threadArena)
+	{
+		pthread_mutex_lock(&arenasLock);
+		threadArena->threads--;
+		pthread_mutex_unlock(&arenasLock);
+	}
+}
+
+static void tcacheCreateKey(void)
+{
+	pthread_key_create(&tcacheKey, tcacheFlush);
+}
+
+/* Arrange for the calling thread's cache to be flushed when it exits */
+static void tcacheRegister(void)
+{
+	if(!tcache.registered)
+	{
+		pthread_once(&tcacheKeyOnce, tcacheCreateKey);
+		pthread_setspecific(tcacheKey, &tcache);
+		tcache.registered = 1;
+	}
+}
+
+/* Push block bp of block size size, or more, on the bin of size,
+ * return 0 if the size is not cached or the bin is full */
+static inline int tcachePush(void *bp, size_t size)
+{
+	int bin = (int)(size/DSIZE) - 2;
+
+	if(size > TCACHE_MAX_SIZE || tcache.counts[bin] == TCACHE_BIN_COUNT)
+		return 0;
+
+	TCACHE_NEXT(bp) = tcache.bins[bin];
+	tcache.bins[bin] = bp;
+	tcache.counts[bin]++;
+	return 1;
+}
+
+/*
+ * tcacheMalloc - Allocate from the calling thread's cache, refilling
+ * the bin from the heap if it is empty. Return NULL if the size is
+ * not cached or the heap is out of memory.
+ */
+static void *tcacheMalloc(size_t size)
+{
+	size_t asize;
+	void *bp, *extra;
+	arena_t *a;
+	int bin, i;
+
+	if(size == 0 || (asize = adjustedSize(size)) > TCACHE_MAX_SIZE)
+		return NULL;
+#if USE_SLAB
+	if(size <= SLAB_MAX_SIZE)
+		return NULL;
+#endif
+
+	bin = (int)(asize/DSIZE) - 2;
+	if((bp = tcache.bins[bin]) != NULL)
+	{
+		tcache.bins[bin] = TCACHE_NEXT(bp);
+		tcache.counts[bin]--;
+		return bp;
+	}
+
+	if((a = threadArena) == NULL)
+		a = assignArena();
+
+	// Refill: keep the first block, and cache the rest in the bin
+	// of their block size, which may be larger if place did not split
+	ARENA_LOCK(a);
+	bp = mallocBlock(size, NULL);
+	for(i = 1; bp && i < TCACHE_BATCH; i++)
+	{
+		if((extra = mallocBlock(size, NULL)) == NULL)
+			break;
+		if(!tcachePush(extra, GET_SIZE(HDRP(extra))))
+			freeBlock(extra);
+	}
+	ARENA_UNLOCK(a);
+
+	return bp;
+}
+
+/*
+ * tcacheFree - Put block bp in the calling thread's cache, flushing
+ * part of the bin to the heap if it is full. Return 0 if the block
+ * is not cached.
+ */
+static int tcacheFree(void *bp)
+{
+#if USE_SLAB
+	if(isSlabSlot(bp))
+		return 0;
+#endif
+
+	return tcacheFreeSized(bp, GET_SIZE(HDRP(bp)));
+}
+
+/*
+ * tcacheFreeSized - Put block bp, not a slot, of at least size bytes
+ * in the calling thread's cache, as tcacheFree does
+ */
+static int tcacheFreeSized(void *bp, size_t size)
+{
+	int bin;
+
+	if(size > TCACHE_MAX_SIZE)
+		return 0;
+
+	tcacheRegister();
+
+	if(!tcachePush(bp, size))
+	{
+		bin = (int)(size/DSIZE) - 2;
+
+		tcacheDrain(&tcache.bins[bin], TCACHE_BATCH);
+		tcache.counts[bin] -= TCACHE_BATCH;
+		tcachePush(bp, size);
+	}
+
+	return 1;
 }
+#endif /* USE_THREADS */
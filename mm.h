@@ -7,6 +7,9 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
 
 #else
 
@@ -15,11 +18,51 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t align, size_t size);
+extern int posix_memalign(void **memptr, size_t align, size_t size);
+extern void *aligned_alloc(size_t align, size_t size);
 
 #endif
 
 extern int mm_init(void);
 
-/* This is largely for debugging.  You can do what you want with the
-   verbose flag; we don't care. */
-extern void mm_checkheap(int verbose);
+/* Statistics of one arena, the heap of a group of threads */
+typedef struct {
+	size_t heapsize;            /* Bytes of memory taken for the heap */
+	size_t allocated;           /* Bytes in allocated blocks */
+	unsigned long mallocs;      /* Blocks allocated from its free lists */
+	unsigned long frees;        /* Blocks freed to its free lists */
+	unsigned long remote_frees; /* Blocks freed by other arenas' threads */
+	int threads;                /* Threads allocating from it */
+} mm_arena_stats_t;
+
+extern int mm_arena_count(void);
+extern int mm_arena_stats(int arena, mm_arena_stats_t *stats);
+
+/* Requests of at least threshold bytes get a mapping of their own,
+   none if threshold is 0 */
+extern void mm_set_mmap_threshold(size_t threshold);
+
+/* Free blocks of at least threshold bytes give their pages back to
+   the system, none if threshold is 0 */
+extern void mm_set_trim_threshold(size_t threshold);
+
+/* Allocate n blocks of size bytes into out, carved together from the
+   heap. Return the number allocated, fewer than n if memory ran out */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/* Free the n blocks in ptrs, which is sorted by address on return */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Free ptr, allocated with size bytes, or up to its usable size */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/* Bytes block ptr can hold, at least what was asked for */
+extern size_t mm_usable_size(void *ptr);
+
+/* Bytes a request of size bytes always gets room for */
+extern size_t mm_good_size(size_t size);
+
+/* Check the heap, printing each block if verbose is set. Return the
+   number of problems found */
+extern int mm_checkheap(int verbose);